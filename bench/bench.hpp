@@ -0,0 +1,45 @@
+﻿#ifndef __BENCH_BENCH_HPP__
+#define __BENCH_BENCH_HPP__
+
+#include <chrono>
+#include <cstdint>
+#include <iomanip>
+#include <iostream>
+#include <string>
+
+// tiny helpers shared by the benchmarks, build them in Release.
+namespace bench {
+
+class stopwatch {
+ public:
+  stopwatch() { reset(); }
+
+  void reset() { start_ = std::chrono::steady_clock::now(); }
+
+  double elapsed() const {
+    std::chrono::duration<double> d = std::chrono::steady_clock::now() - start_;
+    return d.count();
+  }
+
+ private:
+  std::chrono::steady_clock::time_point start_;
+};
+
+inline void report(const std::string& name, uint64_t ops, double seconds) {
+  std::cout << std::left << std::setw(40) << name << std::right
+            << std::setw(10) << std::fixed << std::setprecision(3)
+            << seconds * 1e3 << " ms" << std::setw(12) << std::setprecision(2)
+            << ops / seconds / 1e6 << " Mops/s" << std::endl;
+}
+
+inline void report_bytes(const std::string& name, uint64_t bytes,
+                         double seconds) {
+  std::cout << std::left << std::setw(40) << name << std::right
+            << std::setw(10) << std::fixed << std::setprecision(3)
+            << seconds * 1e3 << " ms" << std::setw(12) << std::setprecision(2)
+            << bytes / seconds / (1 << 30) << " GiB/s" << std::endl;
+}
+
+}  // namespace bench
+
+#endif  // __BENCH_BENCH_HPP__
@@ -0,0 +1,99 @@
+﻿#include <atomic>
+#include <cstdint>
+#include <future>
+#include <memory>
+
+#define DOCTEST_CONFIG_IMPLEMENT_WITH_MAIN
+#include "bench.hpp"
+#include "doctest.h"
+#include "event_queue.hpp"
+using namespace utility;
+
+constexpr int kEvents = 1000000;
+
+static uint64_t sink = 0;
+
+class add_handler : public event_handler {
+ public:
+  explicit add_handler(uint64_t value) : value_(value) {}
+
+  virtual void process() override { sink += value_; }
+
+ private:
+  uint64_t value_;
+};
+
+struct add_event {
+  uint64_t value;
+
+  void process() { sink += value; }
+};
+
+// one producer enqueues kEvents while the owner thread runs loop().
+template <typename Queue, typename MakeEvent>
+void run(const std::string& name, MakeEvent make_event, bool metrics = false) {
+  event_queue_options opts;
+  opts.drain_on_stop = true;
+  opts.metrics = metrics;
+  Queue eq(opts);
+
+  bench::stopwatch sw;
+  auto producer = std::async(std::launch::async, [&eq, &make_event]() {
+    for (int i = 0; i < kEvents; ++i) {
+      eq.enqueue(make_event(i));
+    }
+    eq.stop();
+  });
+
+  eq.loop();
+  producer.wait();
+  bench::report(name, kEvents, sw.elapsed());
+}
+
+TEST_CASE("bench event_queue handler vs value events") {
+  run<event_queue>("shared_ptr<event_handler>", [](int i) {
+    return std::make_shared<add_handler>(i);
+  });
+
+  run<function_queue>("inline_event (lambda)", [](int i) {
+    return inline_event([i]() {
+      sink += i;
+    });
+  });
+
+  run<basic_event_queue<add_event>>("add_event (value)", [](int i) {
+    return add_event{static_cast<uint64_t>(i)};
+  });
+
+  run<mpsc_event_queue>("mpsc shared_ptr<event_handler>", [](int i) {
+    return std::make_shared<add_handler>(i);
+  });
+
+  using mpsc_value_queue =
+      basic_event_queue<add_event, mpsc_ring_queue<add_event>>;
+  run<mpsc_value_queue>("mpsc add_event (value)", [](int i) {
+    return add_event{static_cast<uint64_t>(i)};
+  });
+
+  CHECK_NE(sink, 0);
+}
+
+TEST_CASE("bench event_queue metrics") {
+  auto make_lambda = [](int i) {
+    return inline_event([i]() {
+      sink += i;
+    });
+  };
+  run<function_queue>("inline_event, metrics off", make_lambda);
+  run<function_queue>("inline_event, metrics on", make_lambda, true);
+
+  using mpsc_value_queue =
+      basic_event_queue<add_event, mpsc_ring_queue<add_event>>;
+  auto make_value = [](int i) {
+    return add_event{static_cast<uint64_t>(i)};
+  };
+  run<mpsc_value_queue>("mpsc add_event, metrics off", make_value);
+  run<mpsc_value_queue>("mpsc add_event, metrics on", make_value, true);
+
+  CHECK_NE(sink, 0);
+}
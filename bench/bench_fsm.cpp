@@ -0,0 +1,151 @@
+﻿#include <cstdint>
+#include <string>
+
+#include "bench.hpp"
+#include "doctest.h"
+#include "fsm.hpp"
+using namespace utility;
+
+constexpr int kTransitions = 1000000;
+
+constexpr int32_t kStateA = 1;
+constexpr int32_t kStateB = 2;
+constexpr int32_t kStateC = 3;
+
+static uint64_t visits = 0;
+
+template <int32_t Type>
+class dynamic_state;
+
+// the same a -> b -> c -> a cycle on both machines.
+class dynamic_fsm : public fsm::state_machine_impl<dynamic_fsm> {
+ public:
+  virtual bool init() override;
+
+  virtual void log_state_changed(std::string, std::string,
+                                 const std::string&) override {}
+};
+
+template <int32_t Type>
+class dynamic_state : public fsm::state<dynamic_fsm> {
+ public:
+  struct traits {
+    static constexpr int32_t type() { return Type; }
+    static std::string name() { return "state_" + std::to_string(Type); }
+    static std::shared_ptr<dynamic_state> creator() {
+      return std::make_shared<dynamic_state>();
+    }
+  };
+
+  virtual void enter() override { ++visits; }
+  virtual void exit() override {}
+  virtual bool transfer() override;
+};
+
+template <int32_t Type>
+bool dynamic_state<Type>::transfer() {
+  fsm_->change_state<dynamic_state<Type % 3 + 1>>();
+  return true;
+}
+
+bool dynamic_fsm::init() {
+  register_states<dynamic_state<kStateA>, dynamic_state<kStateB>,
+                  dynamic_state<kStateC>>();
+  return true;
+}
+
+class static_fsm;
+
+template <int32_t Type>
+class static_state : public fsm::static_state<static_fsm> {
+ public:
+  struct traits {
+    static constexpr int32_t type() { return Type; }
+    static std::string name() { return "state_" + std::to_string(Type); }
+  };
+
+  void enter() { ++visits; }
+  bool transfer();
+};
+
+class static_fsm
+    : public fsm::static_state_machine<static_fsm, static_state<kStateA>,
+                                       static_state<kStateB>,
+                                       static_state<kStateC>> {};
+
+template <int32_t Type>
+bool static_state<Type>::transfer() {
+  fsm_->change_state<static_state<Type % 3 + 1>>();
+  return true;
+}
+
+static void init(dynamic_fsm& sm) { sm.init(); }
+static void init(static_fsm&) {}
+
+template <typename Machine, typename Initial>
+void run(const std::string& name) {
+  Machine sm;
+  init(sm);
+  sm.template init_state<Initial>();
+
+  bench::stopwatch sw;
+  for (int i = 0; i < kTransitions; ++i) {
+    sm.trigger_state_transfer();
+  }
+  bench::report(name, kTransitions, sw.elapsed());
+}
+
+TEST_CASE("bench fsm dynamic vs static transitions") {
+  run<dynamic_fsm, dynamic_state<kStateA>>("state_machine_impl");
+  run<static_fsm, static_state<kStateA>>("static_state_machine");
+
+  CHECK_EQ(visits, 2 * (kTransitions + 1));
+}
+
+class ping_pool;
+
+template <int32_t Type>
+class ping_state : public fsm::shared_state<ping_pool> {
+ public:
+  struct traits {
+    static constexpr int32_t type() { return Type; }
+    static std::shared_ptr<ping_state> creator() {
+      return std::make_shared<ping_state>();
+    }
+  };
+};
+
+struct ping_event {};
+
+class ping_pool : public fsm::state_machine_pool<ping_pool> {
+ public:
+  ping_pool() : fsm::state_machine_pool<ping_pool>(4) {
+    register_states<ping_state<0>, ping_state<1>>();
+    add_transition<ping_state<0>, ping_event, ping_state<1>>();
+    add_transition<ping_state<1>, ping_event, ping_state<0>>();
+  }
+};
+
+TEST_CASE("bench fsm state_machine_pool") {
+  constexpr int kInstances = 1000000;
+  constexpr int kRounds = 4;
+
+  ping_pool pool;
+  bench::stopwatch sw;
+  for (int i = 0; i < kInstances; ++i) {
+    pool.create<ping_state<0>>();
+  }
+  bench::report("pool create", kInstances, sw.elapsed());
+
+  sw.reset();
+  for (int r = 0; r < kRounds; ++r) {
+    for (int i = 0; i < kInstances; ++i) {
+      pool.post_event(i, ping_event{});
+    }
+  }
+  pool.stop();
+  bench::report("pool post_event, 4 shards", kInstances * kRounds,
+                sw.elapsed());
+
+  CHECK(pool.is_state<ping_state<0>>(0));
+}
@@ -0,0 +1,376 @@
+﻿#include <atomic>
+#include <cstdint>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <utility>
+#include <vector>
+
+#ifdef __linux__
+#include <fnmatch.h>
+#endif  // __linux__
+
+#include "bench.hpp"
+#include "doctest.h"
+#include "shutil.hpp"
+using namespace utility;
+
+constexpr int kDirs = 64;
+constexpr int kFilesPerDir = 256;
+constexpr size_t kFileSize = 4096;
+
+// the one-thread walk copy_dir() used to do, the baseline.
+static void sequential_copy(const fs::path& src, const fs::path& dest) {
+  fs::create_directories(dest);
+  for (auto& entry : fs::directory_iterator(src)) {
+    auto target = dest / entry.path().filename();
+    if (fs::is_directory(entry.path()))
+      sequential_copy(entry.path(), target);
+    else
+      fs::copy_file(entry.path(), target,
+                    fs::copy_options::overwrite_existing);
+  }
+}
+
+TEST_CASE("bench shutil copy_tree") {
+  auto root = fs::temp_directory_path() / "bench_shutil";
+  auto src = root / "src";
+  fs::remove_all(root);
+
+  std::string content(kFileSize, 'x');
+  for (int i = 0; i < kDirs; ++i) {
+    auto dir = src / ("dir" + std::to_string(i));
+    fs::create_directories(dir);
+    for (int j = 0; j < kFilesPerDir; ++j) {
+      std::ofstream out((dir / ("file" + std::to_string(j))).string());
+      out << content;
+    }
+  }
+
+  constexpr int kFiles = kDirs * kFilesPerDir;
+  bench::stopwatch sw;
+  sequential_copy(src, root / "sequential");
+  bench::report("sequential copy (files)", kFiles, sw.elapsed());
+
+  for (size_t in_flight : {1, 4, 16, 64}) {
+    shutil::copy_options opts;
+    opts.max_in_flight = in_flight;
+    auto dest = root / ("parallel" + std::to_string(in_flight));
+
+    sw.reset();
+    auto result = shutil::copy_tree(src.string(), dest.string(), opts);
+    bench::report("copy_tree, " + std::to_string(in_flight) + " in flight",
+                  kFiles, sw.elapsed());
+    CHECK(result.ok());
+    CHECK_EQ(result.files, kFiles);
+  }
+
+  fs::remove_all(root);
+}
+
+TEST_CASE("bench shutil copy_content") {
+  constexpr size_t kBigSize = size_t(512) << 20;
+
+  auto root = fs::temp_directory_path() / "bench_shutil_content";
+  fs::remove_all(root);
+  fs::create_directories(root);
+  auto src = (root / "big.bin").string();
+  auto dest = (root / "copy.bin").string();
+  {
+    std::ofstream out(src, std::ios::binary);
+    std::string block(1 << 20, 'x');
+    for (size_t i = 0; i < kBigSize / block.size(); ++i) {
+      out << block;
+    }
+  }
+
+  using shutil::copy_method;
+  const std::pair<const char*, copy_method> methods[] = {
+      {"reflink", copy_method::reflink},
+      {"copy_file_range", copy_method::copy_range},
+      {"sendfile", copy_method::sendfile},
+      {"read/write buffer", copy_method::buffered},
+      {"automatic", copy_method::automatic},
+  };
+
+  bench::stopwatch sw;
+  fs::copy_file(src, dest, fs::copy_options::overwrite_existing);
+  bench::report_bytes("fs::copy_file", kBigSize, sw.elapsed());
+
+  for (auto& method : methods) {
+    error_code ec;
+    sw.reset();
+    if (!shutil::copy_content(src, dest, ec, method.second)) {
+      std::cout << method.first << ": " << ec.message() << std::endl;
+      continue;
+    }
+    bench::report_bytes(method.first, kBigSize, sw.elapsed());
+  }
+
+  fs::remove_all(root);
+}
+
+// the recursive glob() walk replaced by shutil::walk(), the baseline.
+static shutil::string_list recursive_glob(const std::string& dir) {
+  shutil::string_list files;
+  for (auto& entry : fs::directory_iterator(fs::path{dir})) {
+    files.emplace_back(entry.path().string());
+    if (fs::is_directory(entry.path())) {
+      auto tmp = recursive_glob(entry.path().string());
+      files.insert(files.end(), tmp.begin(), tmp.end());
+    }
+  }
+  return files;
+}
+
+TEST_CASE("bench shutil walk") {
+  constexpr int kTop = 16;
+  constexpr int kSub = 16;
+  constexpr int kFiles = 256;
+
+  auto root = fs::temp_directory_path() / "bench_shutil_walk";
+  fs::remove_all(root);
+  for (int i = 0; i < kTop; ++i) {
+    for (int j = 0; j < kSub; ++j) {
+      auto dir = root / std::to_string(i) / std::to_string(j);
+      fs::create_directories(dir);
+      for (int k = 0; k < kFiles; ++k) {
+        std::ofstream((dir / std::to_string(k)).string());
+      }
+    }
+  }
+
+  constexpr uint64_t kEntries = kTop + kTop * kSub * (1 + kFiles);
+  bench::stopwatch sw;
+  auto files = recursive_glob(root.string());
+  bench::report("recursive glob (entries)", kEntries, sw.elapsed());
+  CHECK_EQ(files.size(), kEntries);
+
+  sw.reset();
+  uint64_t count = 0;
+  for (auto it = fs::recursive_directory_iterator(root);
+       it != fs::recursive_directory_iterator(); ++it) {
+    ++count;
+  }
+  bench::report("fs::recursive_directory_iterator", kEntries, sw.elapsed());
+  CHECK_EQ(count, kEntries);
+
+  sw.reset();
+  count = 0;
+  shutil::walk(root.string(), [&count](const shutil::walk_entry&) {
+    ++count;
+    return true;
+  });
+  bench::report("walk", kEntries, sw.elapsed());
+  CHECK_EQ(count, kEntries);
+
+  std::atomic<uint64_t> parallel{0};
+  shutil::walk_options opts;
+  opts.threads = 4;
+  sw.reset();
+  shutil::walk(
+      root.string(),
+      [&parallel](const shutil::walk_entry&) {
+        parallel.fetch_add(1, std::memory_order_relaxed);
+        return true;
+      },
+      opts);
+  bench::report("walk, 4 threads", kEntries, sw.elapsed());
+  CHECK_EQ(parallel.load(), kEntries);
+
+  fs::remove_all(root);
+}
+
+#ifdef __linux__
+TEST_CASE("bench shutil pattern_set") {
+  constexpr int kPatterns = 200;
+  constexpr int kPaths = 200000;
+
+  shutil::string_list patterns;
+  for (int i = 0; i < kPatterns; ++i) {
+    patterns.push_back(i % 2 ? "*.ext" + std::to_string(i)
+                             : "tmp" + std::to_string(i) + "_*");
+  }
+  shutil::pattern_set compiled(patterns);
+
+  std::vector<std::string> paths;
+  for (int i = 0; i < kPaths; ++i) {
+    paths.push_back("src/module" + std::to_string(i % 97) + "/file" +
+                    std::to_string(i) + ".ext" + std::to_string(i % 400));
+  }
+
+  bench::stopwatch sw;
+  size_t naive = 0;
+  for (auto& path : paths) {
+    auto name = path.c_str() + path.rfind('/') + 1;
+    for (auto& pattern : patterns) {
+      if (::fnmatch(pattern.c_str(), name, 0) == 0) {
+        ++naive;
+        break;
+      }
+    }
+  }
+  bench::report("fnmatch per pattern (paths)", kPaths, sw.elapsed());
+
+  sw.reset();
+  size_t matched = 0;
+  for (auto& path : paths) {
+    matched += compiled.match(path);
+  }
+  bench::report("pattern_set, 200 patterns", kPaths, sw.elapsed());
+  CHECK_EQ(matched, naive);
+}
+#endif  // __linux__
+
+// the old get_file_size(): glob() each level, then stat entry by entry.
+static uint64_t recursive_size(const std::string& p) {
+  error_code ec;
+  if (fs::is_regular_file(fs::path{p}, ec))
+    return fs::file_size(fs::path{p}, ec);
+
+  uint64_t total = 0;
+  for (auto& entry : shutil::glob(p)) {
+    total += recursive_size(entry);
+  }
+  return total;
+}
+
+TEST_CASE("bench shutil disk_usage") {
+  constexpr int kTop = 16;
+  constexpr int kSub = 16;
+  constexpr int kFiles = 256;
+
+  auto root = fs::temp_directory_path() / "bench_shutil_usage";
+  fs::remove_all(root);
+  for (int i = 0; i < kTop; ++i) {
+    for (int j = 0; j < kSub; ++j) {
+      auto dir = root / std::to_string(i) / std::to_string(j);
+      fs::create_directories(dir);
+      for (int k = 0; k < kFiles; ++k) {
+        std::ofstream(dir / std::to_string(k)) << k;
+      }
+    }
+  }
+
+  constexpr uint64_t kEntries = kTop * kSub * kFiles;
+  bench::stopwatch sw;
+  auto expected = recursive_size(root.string());
+  bench::report("old get_file_size (files)", kEntries, sw.elapsed());
+
+  sw.reset();
+  auto usage = shutil::disk_usage(root.string());
+  bench::report("disk_usage", kEntries, sw.elapsed());
+  CHECK_EQ(usage.bytes, expected);
+
+  shutil::usage_options opts;
+  opts.threads = 4;
+  sw.reset();
+  usage = shutil::disk_usage(root.string(), opts);
+  bench::report("disk_usage, 4 threads", kEntries, sw.elapsed());
+  CHECK_EQ(usage.bytes, expected);
+
+  shutil::usage_cache cache;
+  opts.threads = 0;
+  opts.cache = &cache;
+  shutil::disk_usage(root.string(), opts);
+  sw.reset();
+  usage = shutil::disk_usage(root.string(), opts);
+  bench::report("disk_usage, cached", kEntries, sw.elapsed());
+  CHECK_EQ(usage.bytes, expected);
+
+  fs::remove_all(root);
+}
+
+TEST_CASE("bench shutil remove_tree") {
+  constexpr int kTop = 16;
+  constexpr int kSub = 16;
+  constexpr int kFiles = 128;
+
+  auto root = fs::temp_directory_path() / "bench_shutil_remove";
+  auto trash = fs::temp_directory_path() / "bench_shutil_trash";
+  auto make_tree = [&root]() {
+    for (int i = 0; i < kTop; ++i) {
+      for (int j = 0; j < kSub; ++j) {
+        auto dir = root / std::to_string(i) / std::to_string(j);
+        fs::create_directories(dir);
+        for (int k = 0; k < kFiles; ++k) {
+          std::ofstream(dir / std::to_string(k)) << k;
+        }
+      }
+    }
+  };
+
+  constexpr uint64_t kEntries = kTop * kSub * kFiles;
+  fs::remove_all(root);
+  make_tree();
+  bench::stopwatch sw;
+  fs::remove_all(root);
+  bench::report("fs::remove_all (files)", kEntries, sw.elapsed());
+
+  make_tree();
+  sw.reset();
+  auto result = shutil::remove_tree(root.string());
+  bench::report("remove_tree", kEntries, sw.elapsed());
+  CHECK(result.ok());
+
+  make_tree();
+  shutil::remove_options opts;
+  opts.threads = 4;
+  sw.reset();
+  result = shutil::remove_tree(root.string(), opts);
+  bench::report("remove_tree, 4 threads", kEntries, sw.elapsed());
+  CHECK(result.ok());
+
+  make_tree();
+  sw.reset();
+  auto future = shutil::remove_tree_later(root.string(), trash.string());
+  bench::report("remove_tree_later, caller", kEntries, sw.elapsed());
+  CHECK(future.get().ok());
+
+  fs::remove_all(trash);
+}
+
+TEST_CASE("bench shutil mapped_file") {
+  constexpr size_t kLogSize = size_t(512) << 20;
+
+  auto log = (fs::temp_directory_path() / "bench_shutil_log.txt").string();
+  {
+    std::ofstream out(log, std::ios::binary);
+    std::string line;
+    for (size_t size = 0, i = 0; size < kLogSize; size += line.size(), ++i) {
+      line = "2024-01-01 12:00:00 INFO request " + std::to_string(i) +
+             " served in " + std::to_string(i % 997) + "us\n";
+      out << line;
+    }
+  }
+  auto bytes = fs::file_size(log);
+
+  uint64_t lines = 0;
+  uint64_t chars = 0;
+  bench::stopwatch sw;
+  {
+    std::ifstream in(log, std::ios::binary);
+    std::string line;
+    while (std::getline(in, line)) {
+      ++lines;
+      chars += line.size();
+    }
+  }
+  bench::report_bytes("std::getline", bytes, sw.elapsed());
+
+  uint64_t mapped_lines = 0;
+  uint64_t mapped_chars = 0;
+  sw.reset();
+  {
+    shutil::mapped_file file(log);
+    for (auto line : file.lines()) {
+      ++mapped_lines;
+      mapped_chars += line.size();
+    }
+  }
+  bench::report_bytes("mapped_file lines", bytes, sw.elapsed());
+  CHECK_EQ(mapped_lines, lines);
+  CHECK_EQ(mapped_chars, chars);
+
+  fs::remove(log);
+}
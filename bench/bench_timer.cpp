@@ -0,0 +1,95 @@
+﻿#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <random>
+#include <thread>
+#include <vector>
+
+#include "bench.hpp"
+#include "doctest.h"
+#include "timer.hpp"
+using namespace utility;
+
+TEST_CASE("bench timer add and cancel") {
+  constexpr int kTimers = 1000000;
+
+  std::mt19937 rng(42);
+  std::uniform_int_distribution<int> delay_ms(1000, 60000);
+  std::vector<int> delays(kTimers);
+  for (auto& d : delays) {
+    d = delay_ms(rng);
+  }
+
+  timer t;
+  std::vector<timer::timer_id> ids;
+  ids.reserve(kTimers);
+
+  bench::stopwatch sw;
+  for (auto d : delays) {
+    ids.push_back(t.add(std::chrono::milliseconds(d), []() {}));
+  }
+  bench::report("timer add (1M pending)", kTimers, sw.elapsed());
+  CHECK_EQ(t.size(), kTimers);
+
+  sw.reset();
+  for (auto id : ids) {
+    t.cancel(id);
+  }
+  bench::report("timer cancel", kTimers, sw.elapsed());
+  CHECK_EQ(t.size(), 0);
+}
+
+TEST_CASE("bench timer jitter") {
+  constexpr int kTimers = 2000;
+  using clock = timer::clock;
+
+  std::mt19937 rng(7);
+  std::uniform_int_distribution<int> delay_us(1000, 500000);
+  std::vector<clock::time_point> deadlines(kTimers);
+  std::vector<clock::time_point> fired(kTimers);
+  std::atomic_int32_t count{0};
+
+  timer t;
+  for (int i = 0; i < kTimers; ++i) {
+    deadlines[i] = clock::now() + std::chrono::microseconds(delay_us(rng));
+    t.add_at(deadlines[i], [&fired, &count, i]() {
+      fired[i] = clock::now();
+      count.fetch_add(1);
+    });
+  }
+
+  while (count.load() < kTimers) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+  }
+
+  std::vector<double> late_us(kTimers);
+  for (int i = 0; i < kTimers; ++i) {
+    std::chrono::duration<double, std::micro> late = fired[i] - deadlines[i];
+    late_us[i] = late.count();
+  }
+  std::sort(late_us.begin(), late_us.end());
+
+  std::cout << "timer firing lateness (us): p50 " << late_us[kTimers / 2]
+            << ", p99 " << late_us[kTimers * 99 / 100] << ", max "
+            << late_us.back() << std::endl;
+  CHECK_GE(late_us.front(), 0.0);
+}
+
+TEST_CASE("bench timer fire throughput") {
+  constexpr int kTimers = 1000000;
+  std::atomic_int32_t count{0};
+
+  timer t;
+  auto start = timer::clock::now() + std::chrono::milliseconds(10);
+  for (int i = 0; i < kTimers; ++i) {
+    t.add_at(start + std::chrono::microseconds(i % 200000), [&count]() {
+      count.fetch_add(1, std::memory_order_relaxed);
+    });
+  }
+
+  bench::stopwatch sw;
+  while (count.load() < kTimers) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  }
+  bench::report("timer fire (1M over 200ms)", kTimers, sw.elapsed());
+}
@@ -0,0 +1,115 @@
+﻿#include <chrono>
+#include <future>
+#include <stdexcept>
+#include <thread>
+
+#include "coroutine.hpp"
+#include "doctest.h"
+using namespace utility;
+
+#if __cplusplus >= 202002L && defined(__cpp_impl_coroutine)
+
+static coro::task<int> add_on(function_queue &fq, int a, int b) {
+  co_await coro::schedule(fq);
+  co_return a + b;
+}
+
+static coro::task<std::thread::id> thread_of(event_queue &eq) {
+  co_await coro::schedule(eq, event_priority::high);
+  co_return std::this_thread::get_id();
+}
+
+static coro::task<void> fail_on(function_queue &fq) {
+  co_await coro::schedule(fq);
+  throw std::runtime_error("fail");
+}
+
+TEST_CASE("test coroutine") {
+  event_queue_options opts;
+  opts.thread_count = 1;
+  function_queue fq(opts);
+  event_queue eq(opts);
+
+  auto caller = std::this_thread::get_id();
+
+  SUBCASE("task") {
+    CHECK(coro::sync_wait(add_on(fq, 1, 2)) == 3);
+
+    auto id = coro::sync_wait(thread_of(eq));
+    CHECK(id != caller);
+  }
+
+  SUBCASE("nested task") {
+    auto outer = [](function_queue &fq, event_queue &eq) -> coro::task<int> {
+      int sum = 0;
+      for (int i = 0; i < 100; ++i)
+        sum += co_await add_on(fq, i, 1);
+      co_await thread_of(eq);
+      co_return sum;
+    };
+    CHECK(coro::sync_wait(outer(fq, eq)) == 5050);
+  }
+
+  SUBCASE("exception") {
+    CHECK_THROWS_AS(coro::sync_wait(fail_on(fq)), std::runtime_error);
+  }
+
+  SUBCASE("spawn") {
+    std::atomic_int32_t count{0};
+    auto bump = [](function_queue &fq,
+                   std::atomic_int32_t& count) -> coro::task<void> {
+      co_await coro::schedule(fq);
+      ++count;
+    };
+    for (int i = 0; i < 10; ++i)
+      coro::spawn(bump(fq, count));
+
+    // fq has a single worker, so it runs the spawned tasks in order.
+    coro::sync_wait(add_on(fq, 0, 0));
+    CHECK(count == 10);
+  }
+
+  SUBCASE("dropped by stop") {
+    // nobody runs the loop, stop() drops the continuation: the co_await
+    // throws instead of leaking the frame and blocking sync_wait().
+    event_queue_options idle_opts;
+    idle_opts.metrics = true;
+    function_queue idle(idle_opts);
+    auto result = std::async(std::launch::async, [&idle]() {
+      return coro::sync_wait(add_on(idle, 1, 2));
+    });
+    while (idle.stats().depth == 0)
+      std::this_thread::yield();
+
+    idle.stop();
+    idle.loop();
+    CHECK_THROWS_AS(result.get(), coro::operation_cancelled);
+  }
+
+  SUBCASE("rejected") {
+    event_queue_options full_opts;
+    full_opts.capacity = 1;
+    full_opts.overflow = overflow_policy::fail;
+    function_queue full(full_opts);
+    CHECK(full.enqueue([]() {}));
+
+    auto on_full = [](function_queue &full) -> coro::task<std::thread::id> {
+      try {
+        co_await coro::schedule(full);
+      }
+      catch (const coro::operation_cancelled &) {
+        co_return std::this_thread::get_id();
+      }
+      co_return std::thread::id();
+    };
+    CHECK(coro::sync_wait(on_full(full)) == caller);
+
+    full.stop();
+    full.loop();
+  }
+
+  fq.stop();
+  eq.stop();
+}
+
+#endif  // __cplusplus >= 202002L && defined(__cpp_impl_coroutine)
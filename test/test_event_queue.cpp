@@ -1,10 +1,12 @@
-﻿#include <atomic>
+﻿#include <array>
+#include <atomic>
 #include <chrono>
 #include <functional>
 #include <future>
 #include <iostream>
 #include <string>
 #include <thread>
+#include <vector>
 
 #include "doctest.h"
 #include "event_queue.hpp"
@@ -47,3 +49,556 @@ TEST_CASE("test event_queue") {
 
   CHECK_EQ(counter.load(), 4);
 }
+
+class count_event : public event_handler {
+ public:
+  explicit count_event(std::atomic_int32_t& count) : count_(count) {}
+
+  virtual void process() override {
+    std::this_thread::sleep_for(std::chrono::microseconds(100));
+    count_.fetch_add(1);
+  }
+
+ private:
+  std::atomic_int32_t& count_;
+};
+
+TEST_CASE("test event_queue pool mode") {
+  std::atomic_int32_t count{0};
+
+  event_queue_options opts;
+  opts.thread_count = 4;
+  event_queue eq(opts);
+
+  for (int i = 0; i < 1000; ++i) {
+    eq.enqueue(std::make_shared<count_event>(count));
+  }
+
+  auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(10);
+  while (count.load() < 1000 && std::chrono::steady_clock::now() < deadline) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  }
+
+  eq.stop();
+  CHECK_EQ(count.load(), 1000);
+}
+
+TEST_CASE("test event_queue drain on stop") {
+  std::atomic_int32_t count{0};
+
+  event_queue_options opts;
+  opts.drain_on_stop = true;
+
+  SUBCASE("loop") {
+    event_queue eq(opts);
+    for (int i = 0; i < 100; ++i) {
+      eq.enqueue(std::make_shared<count_event>(count));
+    }
+
+    eq.stop();
+    eq.loop();
+  }
+
+  SUBCASE("pool") {
+    opts.thread_count = 3;
+    event_queue eq(opts);
+    for (int i = 0; i < 100; ++i) {
+      eq.enqueue(std::make_shared<count_event>(count));
+    }
+
+    eq.stop();
+  }
+
+  CHECK_EQ(count.load(), 100);
+}
+
+TEST_CASE("test mpsc_ring_queue") {
+  mpsc_ring_queue<int> ring(3);
+  CHECK_EQ(ring.capacity(), 4);
+  CHECK_EQ(ring.empty(), true);
+
+  for (int i = 0; i < 4; ++i) {
+    CHECK_EQ(ring.push(i), true);
+  }
+
+  int value = 4;
+  CHECK_EQ(ring.push(value), false);
+  CHECK_EQ(ring.size(), 4);
+
+  for (int i = 0; i < 4; ++i) {
+    CHECK_EQ(ring.pop(value), true);
+    CHECK_EQ(value, i);
+  }
+  CHECK_EQ(ring.pop(value), false);
+}
+
+TEST_CASE("test mpsc_event_queue") {
+  std::atomic_int32_t count{0};
+
+  event_queue_options opts;
+  opts.capacity = 64;
+  opts.drain_on_stop = true;
+  mpsc_event_queue eq(opts);
+
+  std::vector<std::thread> producers;
+  for (int i = 0; i < 8; ++i) {
+    producers.emplace_back([&eq, &count]() {
+      for (int n = 0; n < 100; ++n) {
+        eq.enqueue(std::make_shared<count_event>(count));
+      }
+    });
+  }
+
+  auto fut = std::async([&eq, &producers]() {
+    for (auto& producer : producers) {
+      producer.join();
+    }
+    eq.stop();
+  });
+
+  eq.loop();
+  fut.wait();
+
+  CHECK_EQ(count.load(), 800);
+}
+
+TEST_CASE("test mpsc_event_queue full ring") {
+  std::atomic_int32_t count{0};
+
+  // no capacity: the ring's slots are the capacity.
+  mpsc_event_queue eq;
+  size_t queued = 0;
+  for (int i = 0; i < 9000; ++i) {
+    queued += eq.try_enqueue(std::make_shared<count_event>(count));
+  }
+  CHECK_EQ(queued, mpsc_ring_queue<int>::kDefaultCapacity);
+
+  // a producer blocked on the full ring is released by stop().
+  auto fut = std::async([&eq, &count]() {
+    return eq.enqueue(std::make_shared<count_event>(count));
+  });
+  std::this_thread::sleep_for(std::chrono::milliseconds(10));
+  eq.stop();
+  CHECK_EQ(fut.get(), false);
+}
+
+class order_event : public event_handler {
+ public:
+  order_event(std::vector<int>& order, int id) : order_(order), id_(id) {}
+
+  virtual void process() override { order_.push_back(id_); }
+
+ private:
+  std::vector<int>& order_;
+  int id_;
+};
+
+TEST_CASE_TEMPLATE("test event_queue enqueue_bulk", Queue, event_queue,
+                   mpsc_event_queue) {
+  std::vector<int> order;
+  std::vector<event_handler::ptr> events;
+  for (int i = 0; i < 100; ++i) {
+    events.emplace_back(std::make_shared<order_event>(order, i));
+  }
+
+  event_queue_options opts;
+  opts.capacity = 16;
+  opts.max_batch_size = 8;
+  opts.drain_on_stop = true;
+  Queue eq(opts);
+
+  auto fut = std::async([&eq, &events]() {
+    eq.enqueue_bulk(events);
+    eq.stop();
+  });
+
+  eq.loop();
+  fut.wait();
+
+  REQUIRE_EQ(order.size(), events.size());
+  for (int i = 0; i < 100; ++i) {
+    CHECK_EQ(order[i], i);
+  }
+}
+
+struct add_event {
+  int* sum;
+  int value;
+
+  void process() { *sum += value; }
+};
+
+TEST_CASE("test value event_queue") {
+  event_queue_options opts;
+  opts.drain_on_stop = true;
+
+  SUBCASE("process member") {
+    int sum = 0;
+    basic_event_queue<add_event> eq(opts);
+    for (int i = 1; i <= 100; ++i) {
+      eq.enqueue(add_event{&sum, i});
+    }
+
+    eq.stop();
+    eq.loop();
+    CHECK_EQ(sum, 5050);
+  }
+
+  SUBCASE("callable") {
+    std::string out;
+    std::array<char, 128> big{};
+    big[0] = '!';
+
+    function_queue eq(opts);
+    eq.enqueue([&out]() {
+      out += "small";
+    });
+    eq.enqueue([&out, big]() {
+      out += big[0];
+    });
+
+    eq.stop();
+    eq.loop();
+    CHECK_EQ(out, "small!");
+  }
+}
+
+TEST_CASE("test inline_event") {
+  int calls = 0;
+  inline_event ev([&calls]() {
+    ++calls;
+  });
+  CHECK(static_cast<bool>(ev));
+
+  inline_event moved(std::move(ev));
+  CHECK_FALSE(static_cast<bool>(ev));
+
+  moved();
+  ev();
+  CHECK_EQ(calls, 1);
+
+  auto shared = std::make_shared<int>(0);
+  {
+    inline_event holder([shared]() {
+      ++*shared;
+    });
+    CHECK_EQ(shared.use_count(), 2);
+  }
+  CHECK_EQ(shared.use_count(), 1);
+}
+
+TEST_CASE("test event_queue priority") {
+  std::vector<int> order;
+
+  event_queue_options opts;
+  opts.max_batch_size = 1;
+  opts.drain_on_stop = true;
+
+  SUBCASE("strict") {
+    opts.starvation_limit = 0;
+    event_queue eq(opts);
+    eq.enqueue(std::make_shared<order_event>(order, 3), event_priority::low);
+    eq.enqueue(std::make_shared<order_event>(order, 2));
+    eq.enqueue(std::make_shared<order_event>(order, 2));
+    eq.enqueue(std::make_shared<order_event>(order, 1), event_priority::high);
+
+    eq.stop();
+    eq.loop();
+    CHECK_EQ(order, std::vector<int>{1, 2, 2, 3});
+  }
+
+  SUBCASE("starvation limit") {
+    opts.starvation_limit = 2;
+    event_queue eq(opts);
+    eq.enqueue(std::make_shared<order_event>(order, 3), event_priority::low);
+    for (int i = 0; i < 4; ++i) {
+      eq.enqueue(std::make_shared<order_event>(order, 2));
+    }
+
+    eq.stop();
+    eq.loop();
+    CHECK_EQ(order, std::vector<int>{2, 2, 3, 2, 2});
+  }
+}
+
+class stop_event : public event_handler {
+ public:
+  explicit stop_event(event_queue& eq) : eq_(eq) {}
+
+  virtual void process() override { eq_.stop(); }
+
+ private:
+  event_queue& eq_;
+};
+
+TEST_CASE("test event_queue delayed events") {
+  using clock = std::chrono::steady_clock;
+  std::vector<int> order;
+  std::atomic_int32_t ticks{0};
+
+  event_queue eq;
+  auto start = clock::now();
+  eq.enqueue_after(std::chrono::milliseconds(40),
+                   std::make_shared<order_event>(order, 3));
+  eq.enqueue_after(std::chrono::milliseconds(20),
+                   std::make_shared<order_event>(order, 2));
+  auto id = eq.enqueue_after(std::chrono::milliseconds(10),
+                             std::make_shared<order_event>(order, -1));
+  eq.enqueue(std::make_shared<order_event>(order, 1));
+  eq.enqueue_every(std::chrono::milliseconds(5),
+                   std::make_shared<count_event>(ticks));
+  eq.enqueue_after(std::chrono::milliseconds(60),
+                   std::make_shared<stop_event>(eq));
+
+  CHECK_EQ(eq.cancel(id), true);
+  CHECK_EQ(eq.cancel(id), false);
+
+  eq.loop();
+
+  CHECK_EQ(order, std::vector<int>{1, 2, 3});
+  CHECK_GE(clock::now() - start, std::chrono::milliseconds(60));
+  CHECK_GE(ticks.load(), 3);
+}
+
+TEST_CASE("test function_queue delayed events") {
+  function_queue fq;
+  int fired = 0;
+  fq.enqueue_after(std::chrono::milliseconds(1), [&fired]() { ++fired; });
+
+  // floating-point delays round up to the clock's tick.
+  auto start = std::chrono::steady_clock::now();
+  std::chrono::duration<double, std::milli> delay(1.5);
+  fq.enqueue_after(delay, [&fq, &fired]() {
+    ++fired;
+    fq.stop();
+  });
+
+  fq.loop();
+  CHECK_EQ(fired, 2);
+  CHECK_GE(std::chrono::steady_clock::now() - start, delay);
+}
+
+TEST_CASE("test event_queue delayed events pool mode") {
+  std::atomic_int32_t count{0};
+
+  event_queue_options opts;
+  opts.thread_count = 2;
+  event_queue eq(opts);
+  for (int i = 0; i < 10; ++i) {
+    eq.enqueue_after(std::chrono::milliseconds(i),
+                     std::make_shared<count_event>(count));
+  }
+
+  auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+  while (count.load() < 10 && std::chrono::steady_clock::now() < deadline) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  }
+
+  eq.stop();
+  CHECK_EQ(count.load(), 10);
+}
+
+TEST_CASE("test event_queue capacity") {
+  std::vector<int> order;
+
+  event_queue_options opts;
+  opts.capacity = 4;
+  opts.drain_on_stop = true;
+
+  SUBCASE("fail") {
+    opts.overflow = overflow_policy::fail;
+    event_queue eq(opts);
+    for (int i = 0; i < 4; ++i) {
+      CHECK_EQ(eq.enqueue(std::make_shared<order_event>(order, i)), true);
+    }
+    CHECK_EQ(eq.enqueue(std::make_shared<order_event>(order, 4)), false);
+    CHECK_EQ(eq.try_enqueue(std::make_shared<order_event>(order, 5)), false);
+
+    eq.stop();
+    eq.loop();
+    CHECK_EQ(order, std::vector<int>{0, 1, 2, 3});
+  }
+
+  SUBCASE("drop oldest") {
+    opts.overflow = overflow_policy::drop_oldest;
+    event_queue eq(opts);
+    eq.enqueue(std::make_shared<order_event>(order, 0));
+    eq.enqueue(std::make_shared<order_event>(order, 1), event_priority::low);
+    eq.enqueue(std::make_shared<order_event>(order, 2));
+    eq.enqueue(std::make_shared<order_event>(order, 3));
+    CHECK_EQ(eq.try_enqueue(std::make_shared<order_event>(order, 4)), true);
+    CHECK_EQ(eq.enqueue(std::make_shared<order_event>(order, 5)), true);
+
+    eq.stop();
+    eq.loop();
+    CHECK_EQ(order, std::vector<int>{2, 3, 4, 5});
+  }
+
+  SUBCASE("block") {
+    std::atomic_int32_t count{0};
+    opts.capacity = 2;
+    mpsc_event_queue eq(opts);
+
+    std::vector<event_handler::ptr> events;
+    for (int i = 0; i < 100; ++i) {
+      events.emplace_back(std::make_shared<count_event>(count));
+    }
+
+    auto fut = std::async([&eq, &events]() {
+      CHECK_EQ(eq.enqueue_bulk(events), events.size());
+      for (int i = 0; i < 10; ++i) {
+        eq.enqueue(events[i]);
+      }
+      eq.stop();
+    });
+
+    eq.loop();
+    fut.wait();
+    CHECK_EQ(count.load(), 110);
+  }
+}
+
+TEST_CASE("test event_queue delayed events on a full queue") {
+  std::atomic_int32_t count{0};
+
+  event_queue_options opts;
+  opts.capacity = 4;
+  mpsc_event_queue eq(opts);
+  for (int i = 0; i < 4; ++i) {
+    CHECK_EQ(eq.enqueue(std::make_shared<count_event>(count)), true);
+  }
+
+  // due while the ring is full: it waits until the consumer made room.
+  eq.enqueue_after(std::chrono::milliseconds(0),
+                   std::make_shared<count_event>(count));
+
+  auto fut = std::async([&eq, &count]() {
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+    while (count.load() < 5 && std::chrono::steady_clock::now() < deadline) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    eq.stop();
+  });
+
+  eq.loop();
+  fut.wait();
+  CHECK_EQ(count.load(), 5);
+}
+
+TEST_CASE("test event_queue watermark") {
+  std::vector<std::pair<size_t, bool>> marks;
+
+  event_queue_options opts;
+  opts.high_watermark = 3;
+  opts.low_watermark = 1;
+  opts.max_batch_size = 1;
+  opts.drain_on_stop = true;
+  opts.on_watermark = [&marks](size_t depth, bool high) {
+    marks.emplace_back(depth, high);
+  };
+
+  std::vector<int> order;
+  event_queue eq(opts);
+  for (int i = 0; i < 5; ++i) {
+    eq.enqueue(std::make_shared<order_event>(order, i));
+  }
+
+  eq.stop();
+  eq.loop();
+
+  using mark = std::pair<size_t, bool>;
+  CHECK_EQ(marks, std::vector<mark>{mark{3, true}, mark{1, false}});
+}
+
+TEST_CASE("test latency_histogram") {
+  using histogram = latency_histogram;
+
+  CHECK_EQ(histogram::bucket_of(0), 0);
+  CHECK_EQ(histogram::bucket_of(15), 15);
+  CHECK_EQ(histogram::bucket_of(16), 16);
+  CHECK_EQ(histogram::upper_bound(histogram::bucket_of(1000)), 1023);
+  CHECK_EQ(histogram::bucket_of(uint64_t(1) << 50),
+           histogram::kBucketCount - 1);
+
+  histogram h;
+  for (uint64_t ns = 1; ns <= 1000; ++ns)
+    h.record(ns * 1000);
+
+  auto s = h.snapshot();
+  CHECK_EQ(s.count, 1000);
+  CHECK_EQ(s.max, 1000000);
+  CHECK_EQ(s.mean(), doctest::Approx(500500.0));
+
+  // within the 1/16 bucket precision.
+  CHECK_GE(s.percentile(0.5), 500000);
+  CHECK_LE(s.percentile(0.5), 500000 + 500000 / 16);
+  CHECK_GE(s.percentile(0.99), 990000);
+  CHECK_EQ(s.percentile(1.0), 1000000);
+}
+
+TEST_CASE("test event_queue metrics") {
+  event_queue_options opts;
+  opts.drain_on_stop = true;
+
+  SUBCASE("disabled") {
+    event_queue eq(opts);
+    std::vector<int> order;
+    eq.enqueue(std::make_shared<order_event>(order, 1));
+    eq.stop();
+    eq.loop();
+
+    auto stats = eq.stats();
+    CHECK_EQ(stats.peak_depth, 0);
+    CHECK_EQ(stats.process.count, 0);
+    CHECK(stats.handlers.empty());
+  }
+
+  SUBCASE("handler types") {
+    opts.metrics = true;
+    event_queue eq(opts);
+
+    std::vector<int> order;
+    std::atomic_int32_t count{0};
+    for (int i = 0; i < 5; ++i)
+      eq.enqueue(std::make_shared<order_event>(order, i));
+    for (int i = 0; i < 3; ++i)
+      eq.enqueue(std::make_shared<count_event>(count));
+
+    CHECK_EQ(eq.stats().depth, 8);
+
+    eq.stop();
+    eq.loop();
+
+    auto stats = eq.stats();
+    CHECK_EQ(stats.depth, 0);
+    CHECK_EQ(stats.peak_depth, 8);
+    CHECK_EQ(stats.wait.count, 8);
+    CHECK_EQ(stats.process.count, 8);
+    CHECK_GE(stats.process.max, 100000);
+
+    // count_event sleeps, so it leads the list.
+    REQUIRE_EQ(stats.handlers.size(), 2);
+    CHECK_NE(stats.handlers[0].type.find("count_event"), std::string::npos);
+    CHECK_EQ(stats.handlers[0].process.count, 3);
+    CHECK_NE(stats.handlers[1].type.find("order_event"), std::string::npos);
+    CHECK_EQ(stats.handlers[1].process.count, 5);
+  }
+
+  SUBCASE("pool mode") {
+    opts.metrics = true;
+    opts.thread_count = 2;
+    function_queue fq(opts);
+
+    std::atomic_int32_t count{0};
+    for (int i = 0; i < 100; ++i)
+      fq.enqueue([&count]() { count.fetch_add(1); });
+    fq.stop();
+
+    auto stats = fq.stats();
+    CHECK_EQ(count.load(), 100);
+    CHECK_EQ(stats.process.count, 100);
+    CHECK_EQ(stats.wait.count, 100);
+    REQUIRE_EQ(stats.handlers.size(), 1);
+    CHECK_EQ(stats.handlers[0].process.count, 100);
+  }
+}
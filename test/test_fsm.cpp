@@ -1,7 +1,11 @@
-﻿#include <chrono>
+﻿#include <atomic>
+#include <chrono>
 #include <functional>
 #include <iostream>
+#include <sstream>
+#include <string>
 #include <thread>
+#include <vector>
 
 #define DOCTEST_CONFIG_IMPLEMENT_WITH_MAIN
 #include "doctest.h"
@@ -100,3 +104,682 @@ TEST_CASE("test fsm") {
   sm.stop();
   CHECK_EQ(sm.cur_state_type(), 0);
 }
+
+constexpr int32_t kStateOn = 1;
+constexpr int32_t kStateOff = 2;
+
+class on_state;
+class off_state;
+class standby_state;
+
+class switch_fsm : public fsm::state_machine_impl<switch_fsm> {
+ public:
+  virtual bool init() override;
+
+  virtual void log_state_changed(std::string, std::string,
+                                 const std::string&) override {}
+};
+
+class on_state : public fsm::state<switch_fsm> {
+ public:
+  FSM_STATE_TRAITS(on_state, kStateOn);
+
+  virtual void enter() override {}
+  virtual void exit() override {}
+  virtual bool transfer() override { return false; }
+};
+
+class off_state : public fsm::state<switch_fsm> {
+ public:
+  FSM_STATE_TRAITS(off_state, kStateOff);
+
+  virtual void enter() override {}
+  virtual void exit() override {}
+  virtual bool transfer() override { return false; }
+};
+
+// sparse type, kept out of the flat state table.
+constexpr int32_t kStateStandby = 100000;
+
+class standby_state : public fsm::state<switch_fsm> {
+ public:
+  FSM_STATE_TRAITS(standby_state, kStateStandby);
+
+  virtual void enter() override {}
+  virtual void exit() override {}
+  virtual bool transfer() override { return false; }
+};
+
+bool switch_fsm::init() {
+  register_states<on_state, off_state, standby_state>();
+  return true;
+}
+
+TEST_CASE("test fsm registered states") {
+  switch_fsm sm;
+  CHECK_EQ(sm.init(), true);
+  CHECK_EQ(sm.cur_state(), nullptr);
+
+  sm.init_state<on_state>();
+  auto on = sm.cur_state();
+  sm.change_state<standby_state>();
+  CHECK_EQ(sm.cur_state_type(), kStateStandby);
+  auto standby = sm.cur_state();
+  sm.change_state<off_state>();
+  CHECK_EQ(sm.cur_state_name(), std::string("off_state"));
+
+  // flyweights: every transition reuses the registered instance.
+  sm.change_state<on_state>();
+  CHECK_EQ(sm.cur_state(), on);
+  sm.change_state<standby_state>();
+  CHECK_EQ(sm.cur_state(), standby);
+}
+
+TEST_CASE("test fsm trace") {
+  switch_fsm sm;
+  sm.init();
+  sm.enable_trace(4);
+
+  sm.init_state<off_state>();
+  for (int i = 0; i < 10; ++i) {
+    if (i % 2)
+      sm.change_state<off_state>();
+    else
+      sm.change_state<on_state>();
+  }
+
+  // the last 4 of 11 transitions, oldest first.
+  auto trace = sm.trace();
+  REQUIRE_EQ(trace.size(), 4);
+  CHECK_EQ(*trace[0].from, "off_state");
+  CHECK_EQ(*trace[0].to, "on_state");
+  CHECK_EQ(*trace[3].to, "off_state");
+  for (size_t i = 0; i < trace.size(); ++i) {
+    CHECK_LE(trace[i].exit_ns, trace[i].enter_ns);
+    CHECK_LE(trace[i].enter_ns, trace[i].entered_ns);
+    if (i > 0)
+      CHECK_LE(trace[i - 1].entered_ns, trace[i].exit_ns);
+  }
+
+  auto timings = sm.state_timings();
+  REQUIRE_EQ(timings.size(), 3);
+  for (auto& t : timings) {
+    if (t.name == "on_state") {
+      CHECK_EQ(t.enter.count, 5);
+      CHECK_EQ(t.exit.count, 5);
+      CHECK_EQ(t.dwell.count, 5);
+    }
+    else if (t.name == "off_state") {
+      CHECK_EQ(t.enter.count, 6);
+      CHECK_EQ(t.dwell.count, 5);
+    }
+    else {
+      CHECK_EQ(t.enter.count, 0);
+    }
+  }
+
+  std::ostringstream os;
+  sm.write_chrome_trace(os);
+  auto json = os.str();
+  CHECK_EQ(json.find("{\"traceEvents\":["), 0);
+  CHECK_NE(json.find("{\"name\":\"on_state\",\"ph\":\"X\""),
+           std::string::npos);
+  CHECK_NE(json.find("\"name\":\"exit on_state\""), std::string::npos);
+  CHECK_NE(json.find("\"name\":\"enter off_state\""), std::string::npos);
+}
+
+TEST_CASE("test fsm lock-free state reads") {
+  switch_fsm sm;
+  sm.init();
+  sm.init_state<off_state>();
+
+  std::atomic_bool done{false};
+  std::atomic_int32_t mismatches{0};
+  std::vector<std::thread> readers;
+  for (int i = 0; i < 4; ++i) {
+    readers.emplace_back([&sm, &done, &mismatches]() {
+      while (!done.load()) {
+        // every read sees a published state, never a torn one.
+        auto state = sm.cur_state();
+        auto type = sm.cur_state_type();
+        auto& name = sm.cur_state_name();
+        if (type != kStateOn && type != kStateOff)
+          mismatches.fetch_add(1);
+        if (name != "on_state" && name != "off_state")
+          mismatches.fetch_add(1);
+        if (!state)
+          mismatches.fetch_add(1);
+
+        // one read is one snapshot: exactly one of the two states.
+        auto on = std::dynamic_pointer_cast<on_state>(state) != nullptr;
+        auto off = std::dynamic_pointer_cast<off_state>(state) != nullptr;
+        if (on == off)
+          mismatches.fetch_add(1);
+      }
+    });
+  }
+
+  for (int i = 0; i < 10000; ++i) {
+    if (i % 2)
+      sm.change_state<off_state>();
+    else
+      sm.change_state<on_state>();
+  }
+
+  done.store(true);
+  for (auto& t : readers)
+    t.join();
+
+  CHECK_EQ(mismatches.load(), 0);
+  CHECK(sm.is_state<off_state>());
+
+  // the name reference stays valid across transitions.
+  auto& name = sm.cur_state_name();
+  sm.change_state<on_state>();
+  CHECK_EQ(name, std::string("off_state"));
+  CHECK_EQ(sm.cur_state_name(), std::string("on_state"));
+
+  sm.stop();
+  CHECK_EQ(sm.cur_state_name(), std::string(""));
+}
+
+constexpr int32_t kStateRed = 1;
+constexpr int32_t kStateGreen = 2;
+constexpr int32_t kStateYellow = 3;
+
+class red_light;
+class green_light;
+class yellow_light;
+
+class traffic_light;
+
+struct light_counter {
+  int enter{0};
+  int exit{0};
+};
+
+class red_light : public fsm::static_state<traffic_light> {
+ public:
+  FSM_STATE_TRAITS(red_light, kStateRed);
+
+  void enter() { ++counter.enter; }
+  void exit() { ++counter.exit; }
+  bool transfer();
+
+  light_counter counter;
+};
+
+class green_light : public fsm::static_state<traffic_light> {
+ public:
+  FSM_STATE_TRAITS(green_light, kStateGreen);
+
+  void enter() { ++counter.enter; }
+  void exit() { ++counter.exit; }
+  bool transfer();
+
+  light_counter counter;
+};
+
+class yellow_light : public fsm::static_state<traffic_light> {
+ public:
+  FSM_STATE_TRAITS(yellow_light, kStateYellow);
+
+  bool transfer();
+};
+
+class traffic_light
+    : public fsm::static_state_machine<traffic_light, red_light, green_light,
+                                       yellow_light> {};
+
+bool red_light::transfer() {
+  fsm_->change_state<green_light>();
+  return true;
+}
+
+bool green_light::transfer() {
+  fsm_->change_state<yellow_light>();
+  return true;
+}
+
+bool yellow_light::transfer() {
+  fsm_->change_state<red_light>();
+  return true;
+}
+
+TEST_CASE("test static fsm") {
+  traffic_light light;
+  CHECK_EQ(light.cur_state_type(), 0);
+  CHECK_EQ(light.cur_state_name(), std::string("null"));
+  CHECK_EQ(light.trigger_state_transfer(), false);
+
+  light.init_state<red_light>();
+  CHECK(light.is_state<red_light>());
+  CHECK_EQ(light.cur_state_type(), kStateRed);
+  CHECK_EQ(light.cur_state_name(), std::string("red_light"));
+
+  CHECK_EQ(light.trigger_state_transfer(), true);
+  CHECK(light.is_state<green_light>());
+  CHECK_EQ(light.trigger_state_transfer(), true);
+  CHECK_EQ(light.cur_state_type(), kStateYellow);
+  CHECK_EQ(light.trigger_state_transfer(), true);
+  CHECK_EQ(light.cur_state_name(), std::string("red_light"));
+
+  light.try_change_state<red_light>();
+  CHECK_EQ(light.get_state<red_light>().counter.enter, 2);
+  CHECK_EQ(light.get_state<red_light>().counter.exit, 1);
+  CHECK_EQ(light.get_state<green_light>().counter.enter, 1);
+  CHECK_EQ(light.get_state<green_light>().counter.exit, 1);
+
+  light.stop();
+  CHECK_EQ(light.get_state<red_light>().counter.exit, 2);
+  CHECK_EQ(light.cur_state_type(), 0);
+}
+
+constexpr int32_t kStateClosed = 1;
+constexpr int32_t kStateOpened = 2;
+constexpr int32_t kStateLocked = 3;
+
+struct open_event {};
+struct close_event {};
+struct lock_event {
+  int code;
+};
+struct unlock_event {
+  int code;
+};
+
+class door_fsm : public fsm::state_machine_impl<door_fsm> {
+ public:
+  virtual bool init() override;
+
+  virtual void log_state_changed(std::string, std::string next_state_name,
+                                 const std::string&) override {
+    log.push_back("exit->" + next_state_name);
+  }
+
+  int code{0};
+  std::vector<std::string> log;
+};
+
+class door_state : public fsm::state<door_fsm> {
+ public:
+  virtual void enter() override { fsm_->log.push_back("enter"); }
+  virtual void exit() override {}
+  virtual bool transfer() override { return false; }
+};
+
+class closed_state : public door_state {
+ public:
+  FSM_STATE_TRAITS(closed_state, kStateClosed);
+};
+
+class opened_state : public door_state {
+ public:
+  FSM_STATE_TRAITS(opened_state, kStateOpened);
+};
+
+class locked_state : public door_state {
+ public:
+  FSM_STATE_TRAITS(locked_state, kStateLocked);
+};
+
+bool door_fsm::init() {
+  add_transition<closed_state, open_event, opened_state>();
+  add_transition<opened_state, close_event, closed_state>();
+  add_transition<closed_state, lock_event, locked_state>(
+      nullptr, [](door_fsm& door, const lock_event& ev) {
+        door.code = ev.code;
+        door.log.push_back("lock");
+      });
+  add_transition<locked_state, unlock_event, closed_state>(
+      [](door_fsm& door, const unlock_event& ev) {
+        return ev.code == door.code;
+      },
+      [](door_fsm& door, const unlock_event&) {
+        door.log.push_back("unlock");
+      });
+  return true;
+}
+
+TEST_CASE("test fsm events") {
+  door_fsm door;
+  door.init();
+  door.init_state<closed_state>();
+  door.log.clear();
+
+  SUBCASE("transition table") {
+    CHECK(door.process_event(open_event{}));
+    CHECK(door.is_state<opened_state>());
+    CHECK_FALSE(door.process_event(lock_event{42}));
+    CHECK(door.process_event(close_event{}));
+    CHECK(door.process_event(lock_event{42}));
+
+    // the guard rejects a wrong code.
+    CHECK_FALSE(door.process_event(unlock_event{1}));
+    CHECK(door.is_state<locked_state>());
+    CHECK(door.process_event(unlock_event{42}));
+    CHECK(door.is_state<closed_state>());
+
+    // exit, action, then enter.
+    std::vector<std::string> log{
+        "exit->opened_state", "enter", "exit->closed_state",
+        "enter",              "exit->locked_state", "lock",
+        "enter",              "exit->closed_state", "unlock",
+        "enter"};
+    CHECK_EQ(door.log, log);
+  }
+
+  SUBCASE("posted events") {
+    std::vector<std::thread::id> threads;
+    door.set_state_changed_notifier([&threads]() {
+      threads.push_back(std::this_thread::get_id());
+    });
+
+    for (int i = 0; i < 100; ++i) {
+      door.post_event(open_event{});
+      door.post_event(close_event{});
+    }
+    door.post_event(lock_event{7});
+    door.post_event(unlock_event{8});
+
+    door.stop();
+    CHECK_EQ(threads.size(), 201);
+    CHECK_NE(threads.front(), std::this_thread::get_id());
+    CHECK_EQ(door.log.back(), "enter");
+    CHECK_EQ(door.log[door.log.size() - 2], "lock");
+  }
+
+  SUBCASE("external event queue") {
+    event_queue_options opts;
+    opts.thread_count = 1;
+    function_queue fq(opts);
+    door.set_event_queue(fq);
+
+    door.post_event(open_event{});
+    door.post_event(close_event{});
+    door.stop();
+    CHECK_EQ(door.log.size(), 4);
+    fq.stop();
+  }
+
+  SUBCASE("external event queue stopped without drain") {
+    // fq's loop starts after stop() and drops the posted events: the
+    // machine must still stop and be destroyed.
+    function_queue fq;
+    {
+      door_fsm other;
+      other.init();
+      other.init_state<closed_state>();
+      other.set_event_queue(fq);
+
+      other.post_event(open_event{});
+      other.post_event(close_event{});
+      fq.stop();
+      fq.loop();
+      CHECK(other.is_state<closed_state>());
+    }
+  }
+}
+
+constexpr int32_t kPlayerIdle = 1;
+constexpr int32_t kPlayerActive = 2;
+constexpr int32_t kPlayerLoading = 3;
+constexpr int32_t kPlayerPlaying = 4;
+constexpr int32_t kPlayerNormal = 5;
+constexpr int32_t kPlayerFast = 6;
+constexpr int32_t kPlayerPaused = 7;
+
+struct play_event {};
+struct pause_event {};
+struct resume_event {};
+struct fast_event {};
+struct eject_event {};
+struct insert_event {};
+struct rewind_event {};
+
+class player_fsm : public fsm::state_machine_impl<player_fsm> {
+ public:
+  // the states log into members, leave them before those are destroyed.
+  ~player_fsm() { stop(); }
+
+  virtual bool init() override;
+
+  virtual void log_state_changed(std::string, std::string,
+                                 const std::string&) override {}
+
+  std::vector<std::string> log;
+};
+
+template <typename Self>
+class player_state : public fsm::state<player_fsm> {
+ public:
+  virtual void enter() override {
+    fsm_->log.push_back("+" + Self::traits::name());
+  }
+  virtual void exit() override {
+    fsm_->log.push_back("-" + Self::traits::name());
+  }
+  virtual bool transfer() override { return false; }
+};
+
+class idle : public player_state<idle> {
+ public:
+  FSM_STATE_TRAITS(idle, kPlayerIdle);
+};
+
+class active : public player_state<active> {
+ public:
+  FSM_STATE_TRAITS(active, kPlayerActive);
+};
+
+class loading : public player_state<loading> {
+ public:
+  FSM_SUBSTATE_TRAITS(loading, kPlayerLoading, active);
+};
+
+class playing : public player_state<playing> {
+ public:
+  FSM_SUBSTATE_TRAITS(playing, kPlayerPlaying, active);
+};
+
+class normal : public player_state<normal> {
+ public:
+  FSM_SUBSTATE_TRAITS(normal, kPlayerNormal, playing);
+};
+
+class fast : public player_state<fast> {
+ public:
+  FSM_SUBSTATE_TRAITS(fast, kPlayerFast, playing);
+};
+
+class paused : public player_state<paused> {
+ public:
+  FSM_SUBSTATE_TRAITS(paused, kPlayerPaused, active);
+};
+
+bool player_fsm::init() {
+  set_initial_state<active, loading>();
+  set_initial_state<playing, normal>();
+  add_transition<idle, insert_event, active>();
+  add_transition<loading, play_event, playing>();
+  add_transition<playing, pause_event, paused>();
+  add_transition<normal, fast_event, fast>();
+  add_transition<paused, resume_event, playing>();
+  // handled by the composite whatever its active substate.
+  add_transition<active, eject_event, idle>();
+  add_transition<active, rewind_event, normal>();
+  return true;
+}
+
+TEST_CASE("test fsm hierarchical states") {
+  player_fsm player;
+  player.init();
+  player.init_state<idle>();
+  CHECK(player.process_event(insert_event{}));
+  CHECK(player.is_state<loading>());
+  CHECK(player.is_in<active>());
+  CHECK(player.process_event(play_event{}));
+  CHECK(player.process_event(fast_event{}));
+  CHECK(player.is_state<fast>());
+  CHECK(player.is_in<playing>());
+  CHECK(player.is_in<active>());
+  CHECK_FALSE(player.is_in<idle>());
+  player.log.clear();
+
+  SUBCASE("least common ancestor") {
+    CHECK(player.process_event(pause_event{}));
+    CHECK(player.process_event(resume_event{}));
+    CHECK(player.is_state<normal>());
+    CHECK(player.process_event(eject_event{}));
+    CHECK(player.is_state<idle>());
+    CHECK_FALSE(player.is_in<active>());
+
+    std::vector<std::string> log{"-fast",    "-playing", "+paused",
+                                 "-paused",  "+playing", "+normal",
+                                 "-normal",  "-playing", "-active",
+                                 "+idle"};
+    CHECK_EQ(player.log, log);
+  }
+
+  SUBCASE("row source above its target") {
+    // from active down to normal: everything below active is left, even
+    // playing, which normal is in as well.
+    CHECK(player.process_event(rewind_event{}));
+    CHECK(player.is_state<normal>());
+    std::vector<std::string> log{"-fast", "-playing", "+playing", "+normal"};
+    CHECK_EQ(player.log, log);
+  }
+
+  SUBCASE("shallow history") {
+    player.set_history<active>(fsm::history_type::shallow);
+    CHECK(player.process_event(eject_event{}));
+    CHECK(player.process_event(insert_event{}));
+    // back to playing, which starts over from its initial state.
+    CHECK(player.is_state<normal>());
+    CHECK(player.is_in<playing>());
+  }
+
+  SUBCASE("deep history") {
+    player.set_history<active>(fsm::history_type::deep);
+    CHECK(player.process_event(eject_event{}));
+    CHECK(player.process_event(insert_event{}));
+    CHECK(player.is_state<fast>());
+
+    std::vector<std::string> log{"-fast",   "-playing", "-active", "+idle",
+                                 "-idle",   "+active",  "+playing", "+fast"};
+    CHECK_EQ(player.log, log);
+  }
+
+  SUBCASE("stop exits every active state") {
+    player.stop();
+    std::vector<std::string> log{"-fast", "-playing", "-active"};
+    CHECK_EQ(player.log, log);
+  }
+}
+
+constexpr uint8_t kSessionIdle = 0;
+constexpr uint8_t kSessionActive = 1;
+constexpr uint8_t kSessionClosed = 2;
+
+struct connect_event {};
+struct data_event {
+  uint32_t bytes;
+};
+struct disconnect_event {};
+
+class session_pool;
+
+std::atomic_int32_t sessions_closed{0};
+
+class idle_session : public fsm::shared_state<session_pool> {
+ public:
+  FSM_STATE_TRAITS(idle_session, kSessionIdle);
+};
+
+class active_session : public fsm::shared_state<session_pool> {
+ public:
+  FSM_STATE_TRAITS(active_session, kSessionActive);
+};
+
+class closed_session : public fsm::shared_state<session_pool> {
+ public:
+  FSM_STATE_TRAITS(closed_session, kSessionClosed);
+
+  virtual void enter(session_pool&, fsm::instance_id) override {
+    sessions_closed.fetch_add(1);
+  }
+};
+
+class session_pool : public fsm::state_machine_pool<session_pool> {
+ public:
+  explicit session_pool(size_t count)
+      : fsm::state_machine_pool<session_pool>(4) {
+    bytes.resize(count);
+    register_states<idle_session, active_session, closed_session>();
+
+    add_transition<idle_session, connect_event, active_session>();
+    // data keeps the session active: a self-transition, exit() and enter()
+    // run again around the action.
+    add_transition<active_session, data_event, active_session>(
+        nullptr, [](session_pool& pool, fsm::instance_id id,
+                    const data_event& ev) {
+          pool.bytes[id] += ev.bytes;
+        });
+    add_transition<active_session, disconnect_event, closed_session>();
+  }
+
+  // per-instance data, indexed by the instance id.
+  std::vector<uint64_t> bytes;
+};
+
+TEST_CASE("test fsm state_machine_pool") {
+  constexpr int kSessions = 10000;
+  session_pool pool(kSessions);
+  CHECK_EQ(pool.shard_count(), 4);
+
+  std::vector<fsm::instance_id> ids;
+  for (int i = 0; i < kSessions; ++i)
+    ids.push_back(pool.create<idle_session>());
+  CHECK_EQ(pool.size(), kSessions);
+  CHECK(pool.is_state<idle_session>(ids.back()));
+
+  for (auto id : ids) {
+    pool.post_event(id, connect_event{});
+    pool.post_event(id, data_event{10});
+    pool.post_event(id, data_event{id});
+    if (id % 2)
+      pool.post_event(id, disconnect_event{});
+    // no row for data in the closed state.
+    pool.post_event(id, data_event{1000});
+  }
+
+  // destroyed on its shard before stop() returns.
+  auto extra = pool.create<closed_session>();
+  pool.destroy(extra);
+
+  // unknown ids are ignored on the shards.
+  CHECK(pool.post_event(0xfffffff0, connect_event{}));
+  pool.destroy(0xfffffff0);
+
+  pool.stop();
+
+  int closed = 0;
+  int mismatches = 0;
+  for (auto id : ids) {
+    mismatches += pool.bytes[id] != (id % 2 ? 10 + id : 1010 + id);
+    closed += pool.is_state<closed_session>(id);
+  }
+  CHECK_EQ(mismatches, 0);
+  CHECK_EQ(closed, kSessions / 2);
+  CHECK_EQ(sessions_closed.load(), kSessions / 2 + 1);
+  CHECK_EQ(pool.size(), kSessions);
+  CHECK_EQ(pool.state_of(extra), session_pool::kNoState);
+  CHECK_EQ(pool.state_of(kSessions + 100), session_pool::kNoState);
+  CHECK_EQ(pool.state_of(0xfffffff0), session_pool::kNoState);
+  CHECK_FALSE(pool.process_event(kSessions + 100, connect_event{}));
+  CHECK_FALSE(pool.process_event(0xfffffff0, connect_event{}));
+
+  // the id is reused once its instance is gone.
+  CHECK_EQ(pool.create<idle_session>(), extra);
+  CHECK(pool.is_state<idle_session>(extra));
+}
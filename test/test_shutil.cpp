@@ -1,4 +1,16 @@
-﻿#include <fstream>
+﻿#include <algorithm>
+#include <atomic>
+#include <fstream>
+#include <mutex>
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
+
+#ifdef __linux__
+#include <sys/stat.h>
+#include <unistd.h>
+#endif  // __linux__
 
 #include "doctest.h"
 #include "shutil.hpp"
@@ -75,3 +87,673 @@ TEST_CASE("test shutil") {
   CHECK_EQ(shutil::remove_dir(filepath), false);
   CHECK_EQ(shutil::remove_file(filepath), true);
 }
+
+TEST_CASE("test shutil copy_tree") {
+  std::string src = "copy_tree_src";
+  std::string dest = "copy_tree_dest";
+  shutil::remove_dir(src);
+  shutil::remove_dir(dest);
+
+  for (int i = 0; i < 8; ++i) {
+    auto dir = shutil::path_join(src, "dir" + std::to_string(i));
+    auto sub = shutil::path_join(dir, "sub");
+    CHECK(shutil::make_dir(sub));
+    for (int j = 0; j < 16; ++j) {
+      auto name = "file" + std::to_string(j) + ".txt";
+      CHECK(write_file(shutil::path_join(dir, name), dir + name));
+      CHECK(write_file(shutil::path_join(sub, name), sub + name));
+    }
+  }
+  CHECK(write_file(shutil::path_join(src, "skip.txt"), "skip"));
+  CHECK(write_file(shutil::path_join(src, "top.txt"), "0123456789"));
+
+  shutil::copy_options opts;
+  opts.max_in_flight = 4;
+  opts.max_pending = 8;
+  opts.skip_items = {"skip.txt"};
+  auto result = shutil::copy_tree(src, dest, opts);
+  CHECK(result.ok());
+  CHECK_EQ(result.files, 8 * 32 + 1);
+  CHECK_EQ(result.dirs, 1 + 8 * 2);
+  CHECK_EQ(result.bytes, shutil::get_file_size(src) - 4);
+
+  CHECK_EQ(read_file(shutil::path_join(dest, "top.txt")), "0123456789");
+  CHECK_FALSE(shutil::is_exist(shutil::path_join(dest, "skip.txt")));
+  CHECK_EQ(shutil::glob(src, true).size(), shutil::glob(dest, true).size() + 1);
+  auto sub = shutil::path_join(shutil::path_join(dest, "dir3"), "sub");
+  CHECK_EQ(read_file(shutil::path_join(sub, "file7.txt")),
+           shutil::path_join(shutil::path_join(src, "dir3"), "sub") +
+               "file7.txt");
+
+  SUBCASE("per file errors") {
+    // a directory in the way of one file, the others are still copied.
+    auto blocked = shutil::path_join(dest, "top.txt");
+    CHECK(shutil::remove_file(blocked));
+    CHECK(shutil::make_dir(blocked));
+
+    result = shutil::copy_tree(src, dest, opts);
+    CHECK_EQ(result.errors.size(), 1);
+    CHECK_EQ(result.errors[0].path, shutil::path_join(src, "top.txt"));
+    CHECK(result.errors[0].ec);
+    CHECK_EQ(result.files, 8 * 32);
+    CHECK_FALSE(shutil::copy_dir(src, dest, {"skip.txt"}));
+  }
+
+  SUBCASE("missing source") {
+    result = shutil::copy_tree("copy_tree_missing", dest);
+    CHECK_EQ(result.errors.size(), 1);
+    CHECK_EQ(result.files, 0);
+    CHECK_FALSE(shutil::is_exist("copy_tree_missing"));
+  }
+
+  CHECK(shutil::remove_dir(src));
+  CHECK(shutil::remove_dir(dest));
+}
+
+TEST_CASE("test shutil copy_content") {
+  std::string src = "copy_content_src.bin";
+  std::string dest = "copy_content_dest.bin";
+  std::string content;
+  for (int i = 0; i < 300000; ++i) {
+    content += static_cast<char>('a' + i % 26);
+  }
+  CHECK(write_file(src, content));
+
+  using shutil::copy_method;
+  for (auto method : {copy_method::automatic, copy_method::copy_range,
+                      copy_method::sendfile, copy_method::buffered}) {
+    error_code ec;
+    CHECK(write_file(dest, "stale content to overwrite"));
+    CHECK(shutil::copy_content(src, dest, ec, method));
+    CHECK_FALSE(ec);
+    CHECK_EQ(read_file(dest), content);
+  }
+
+  // not every filesystem can share extents.
+  error_code ec;
+  if (shutil::copy_content(src, dest, ec, copy_method::reflink))
+    CHECK_EQ(read_file(dest), content);
+  else
+    CHECK(ec);
+
+  CHECK_FALSE(shutil::copy_content("copy_content_missing", dest, ec));
+  CHECK(ec);
+
+  SUBCASE("same file") {
+    // onto itself, refused before dest is truncated.
+    CHECK_FALSE(shutil::copy_content(src, src, ec));
+    CHECK(ec);
+    CHECK_FALSE(shutil::copy_file(src, "."));
+    CHECK_EQ(read_file(src), content);
+
+    std::string dir = "copy_content_dir";
+    CHECK(shutil::make_dir(dir));
+    CHECK(write_file(shutil::path_join(dir, "x.txt"), "hello world"));
+    CHECK_FALSE(shutil::copy_tree(dir, dir).ok());
+    CHECK_EQ(read_file(shutil::path_join(dir, "x.txt")), "hello world");
+    CHECK(shutil::remove_dir(dir));
+  }
+
+#ifdef __linux__
+  SUBCASE("sparse file") {
+    // 8MiB with 4KiB of data in the middle.
+    constexpr off_t kSize = 8 << 20;
+    {
+      std::ofstream out(src, std::ios::binary | std::ios::trunc);
+      out.seekp(kSize / 2);
+      out << std::string(4096, 'x');
+    }
+    CHECK(::truncate(src.c_str(), kSize) == 0);
+
+    for (auto method : {copy_method::copy_range, copy_method::sendfile,
+                        copy_method::buffered}) {
+      CHECK(shutil::copy_content(src, dest, ec, method));
+      CHECK_EQ(shutil::get_file_size(dest), kSize);
+
+      struct stat st;
+      CHECK(::stat(dest.c_str(), &st) == 0);
+      CHECK_LT(st.st_blocks * 512, kSize / 2);
+      CHECK_EQ(read_file(dest), read_file(src));
+    }
+  }
+#endif  // __linux__
+
+  CHECK(shutil::remove_file(src));
+  CHECK(shutil::remove_file(dest));
+}
+
+TEST_CASE("test shutil copy_tree sync") {
+  std::string src = "sync_src";
+  std::string dest = "sync_dest";
+  shutil::remove_dir(src);
+  shutil::remove_dir(dest);
+
+  auto sub = shutil::path_join(src, "sub");
+  CHECK(shutil::make_dir(sub));
+  for (int i = 0; i < 10; ++i) {
+    auto name = "file" + std::to_string(i) + ".txt";
+    CHECK(write_file(shutil::path_join(src, name), "content" + name));
+    CHECK(write_file(shutil::path_join(sub, name), "content" + name));
+  }
+
+  shutil::copy_options opts;
+  opts.update = shutil::update_mode::size_and_mtime;
+  auto result = shutil::copy_tree(src, dest, opts);
+  CHECK(result.ok());
+  CHECK_EQ(result.files, 20);
+  CHECK_EQ(result.skipped_files, 0);
+
+  // nothing changed.
+  result = shutil::copy_tree(src, dest, opts);
+  CHECK_EQ(result.files, 0);
+  CHECK_EQ(result.bytes, 0);
+  CHECK_EQ(result.skipped_files, 20);
+  CHECK_EQ(result.skipped_bytes, shutil::get_file_size(src));
+
+  // same size and mtime, other bytes: only content notices it.
+  auto changed = shutil::path_join(sub, "file3.txt");
+  auto mtime = fs::last_write_time(changed);
+  CHECK(write_file(changed, "CONTENTfile3.txt"));
+  fs::last_write_time(changed, mtime);
+
+  result = shutil::copy_tree(src, dest, opts);
+  CHECK_EQ(result.files, 0);
+  opts.update = shutil::update_mode::content;
+  result = shutil::copy_tree(src, dest, opts);
+  CHECK_EQ(result.files, 1);
+  CHECK_EQ(result.skipped_files, 19);
+  CHECK_EQ(read_file(shutil::path_join(shutil::path_join(dest, "sub"),
+                                       "file3.txt")),
+           "CONTENTfile3.txt");
+
+  SUBCASE("delete extra") {
+    CHECK(write_file(shutil::path_join(dest, "extra.txt"), "extra"));
+    CHECK(write_file(shutil::path_join(dest, "keep.txt"), "keep"));
+    auto extra_dir = shutil::path_join(dest, "extra_dir");
+    CHECK(shutil::make_dir(extra_dir));
+    CHECK(write_file(shutil::path_join(extra_dir, "a.txt"), "a"));
+
+    opts.delete_extra = true;
+    opts.skip_items = {"keep.txt"};
+    result = shutil::copy_tree(src, dest, opts);
+    CHECK(result.ok());
+    CHECK_EQ(result.deleted, 3);
+    CHECK_EQ(result.files, 0);
+    CHECK_FALSE(shutil::is_exist(shutil::path_join(dest, "extra.txt")));
+    CHECK_FALSE(shutil::is_exist(extra_dir));
+    CHECK(shutil::is_exist(shutil::path_join(dest, "keep.txt")));
+  }
+
+  CHECK(shutil::remove_dir(src));
+  CHECK(shutil::remove_dir(dest));
+}
+
+TEST_CASE("test shutil walk") {
+  std::string root = "walk_root";
+  shutil::remove_dir(root);
+
+  std::set<std::string> expected;
+  for (int i = 0; i < 4; ++i) {
+    auto dir = shutil::path_join(root, "dir" + std::to_string(i));
+    auto sub = shutil::path_join(dir, "sub");
+    CHECK(shutil::make_dir(sub));
+    expected.insert(dir);
+    expected.insert(sub);
+    for (int j = 0; j < 5; ++j) {
+      auto name = "file" + std::to_string(j);
+      CHECK(write_file(shutil::path_join(dir, name), name));
+      CHECK(write_file(shutil::path_join(sub, name), name));
+      expected.insert(shutil::path_join(dir, name));
+      expected.insert(shutil::path_join(sub, name));
+    }
+  }
+
+  std::set<std::string> visited;
+  size_t dirs = 0;
+  size_t max_depth = 0;
+  auto errors = shutil::walk(root, [&](const shutil::walk_entry& entry) {
+    visited.insert(entry.path);
+    CHECK_EQ(shutil::path_join(
+                 entry.path.substr(0, entry.name_offset - 1), entry.name()),
+             entry.path);
+    if (entry.type == shutil::entry_type::directory)
+      ++dirs;
+    max_depth = std::max(max_depth, entry.depth);
+    return true;
+  });
+  CHECK(errors.empty());
+  CHECK_EQ(visited, expected);
+  CHECK_EQ(dirs, 8);
+  CHECK_EQ(max_depth, 2);
+
+  auto files = shutil::glob(root, true);
+  CHECK_EQ(std::set<std::string>(files.begin(), files.end()), expected);
+  CHECK_EQ(shutil::glob(root).size(), 4);
+
+  SUBCASE("prune") {
+    size_t count = 0;
+    shutil::walk(root, [&count](const shutil::walk_entry& entry) {
+      ++count;
+      return std::string(entry.name()) != "sub";
+    });
+    CHECK_EQ(count, expected.size() - 4 * 5);
+  }
+
+  SUBCASE("parallel") {
+    shutil::walk_options opts;
+    opts.threads = 4;
+    std::mutex mtx;
+    std::set<std::string> parallel;
+    errors = shutil::walk(
+        root,
+        [&](const shutil::walk_entry& entry) {
+          std::lock_guard<std::mutex> guard(mtx);
+          parallel.insert(entry.path);
+          return true;
+        },
+        opts);
+    CHECK(errors.empty());
+    CHECK_EQ(parallel, expected);
+  }
+
+#ifdef __linux__
+  SUBCASE("symlinks") {
+    fs::create_directory_symlink("dir0", shutil::path_join(root, "link"));
+    size_t links = 0;
+    size_t count = 0;
+    shutil::walk(root, [&](const shutil::walk_entry& entry) {
+      links += entry.type == shutil::entry_type::symlink;
+      ++count;
+      return true;
+    });
+    CHECK_EQ(links, 1);
+    CHECK_EQ(count, expected.size() + 1);
+
+    shutil::walk_options opts;
+    opts.follow_symlinks = true;
+    count = 0;
+    shutil::walk(
+        root,
+        [&count](const shutil::walk_entry& entry) {
+          CHECK_NE(entry.type, shutil::entry_type::symlink);
+          ++count;
+          return true;
+        },
+        opts);
+    CHECK_EQ(count, expected.size() + 1 + 1 + 5 + 5);
+  }
+#endif  // __linux__
+
+  SUBCASE("missing directory") {
+    errors = shutil::walk("walk_missing",
+                          [](const shutil::walk_entry&) { return true; });
+    CHECK_EQ(errors.size(), 1);
+    CHECK_EQ(errors[0].path, "walk_missing");
+  }
+
+  CHECK(shutil::remove_dir(root));
+}
+
+TEST_CASE("test shutil pattern_set") {
+  shutil::pattern_set empty;
+  CHECK(empty.empty());
+  CHECK_FALSE(empty.match("a.txt"));
+
+  shutil::pattern_set names{"*.txt", "?.log", "data[0-9]", "[!a-c]x"};
+  CHECK(names.match("a.txt"));
+  CHECK(names.match("src/deep/a.txt"));
+  CHECK(names.match(".txt"));
+  CHECK_FALSE(names.match("a.txt.bak"));
+  CHECK_FALSE(names.match("atxt"));
+  CHECK(names.match("x/b.log"));
+  CHECK_FALSE(names.match("ab.log"));
+  CHECK(names.match("data7"));
+  CHECK_FALSE(names.match("datax"));
+  CHECK(names.match("dx"));
+  CHECK_FALSE(names.match("bx"));
+
+  // with a '/' the whole relative path has to match.
+  shutil::pattern_set paths{"src/*.cpp", "/build", "docs/**/*.md",
+                            "third_party/**", "cache/"};
+  CHECK(paths.match("src/a.cpp"));
+  CHECK_FALSE(paths.match("src/sub/a.cpp"));
+  CHECK_FALSE(paths.match("lib/src/a.cpp"));
+  CHECK(paths.match("build"));
+  CHECK_FALSE(paths.match("sub/build"));
+  CHECK(paths.match("docs/a.md"));
+  CHECK(paths.match("docs/x/y/a.md"));
+  CHECK_FALSE(paths.match("docsx/a.md"));
+  CHECK(paths.match("third_party/doctest/doctest.h"));
+  CHECK_FALSE(paths.match("third_party"));
+  CHECK(paths.match("x/cache", true));
+  CHECK_FALSE(paths.match("x/cache", false));
+
+  shutil::pattern_set special{"a\\*b", "[ab", "**/x/**/y"};
+  CHECK(special.match("a*b"));
+  CHECK_FALSE(special.match("aab"));
+  CHECK(special.match("[ab"));
+  CHECK(special.match("x/y"));
+  CHECK(special.match("p/x/q/r/y"));
+  CHECK_FALSE(special.match("px/y"));
+
+  shutil::pattern_set escaped{shutil::pattern_set::escape("a[1]*?.txt")};
+  CHECK(escaped.match("dir/a[1]*?.txt"));
+  CHECK_FALSE(escaped.match("a1xy.txt"));
+
+  // copy_dir() skips the names literally, as it did before patterns.
+  std::string src = "pattern_src";
+  std::string dest = "pattern_dest";
+  shutil::remove_dir(src);
+  shutil::remove_dir(dest);
+  CHECK(shutil::make_dir(src));
+  for (auto name : {"a[1].txt", "a1.txt", "b.txt"}) {
+    CHECK(write_file(shutil::path_join(src, name), name));
+  }
+  CHECK(shutil::copy_dir(src, dest, {"a[1].txt", "*.txt"}));
+  CHECK_FALSE(shutil::is_exist(shutil::path_join(dest, "a[1].txt")));
+  CHECK(shutil::is_exist(shutil::path_join(dest, "a1.txt")));
+  CHECK(shutil::is_exist(shutil::path_join(dest, "b.txt")));
+  CHECK(shutil::remove_dir(src));
+  CHECK(shutil::remove_dir(dest));
+
+  // the dfa states are built on first use, from every thread at once.
+  shutil::pattern_set shared{"*.txt", "*.log", "src/**/test_*"};
+  std::atomic_int32_t matched{0};
+  std::vector<std::thread> threads;
+  for (int t = 0; t < 4; ++t) {
+    threads.emplace_back([&shared, &matched]() {
+      for (int i = 0; i < 1000; ++i) {
+        auto n = std::to_string(i);
+        matched += shared.match("dir" + n + "/file" + n + ".txt");
+        matched += shared.match("src/" + n + "/test_" + n);
+        matched += shared.match("file" + n + ".cpp");
+      }
+    });
+  }
+  for (auto& t : threads) {
+    t.join();
+  }
+  CHECK_EQ(matched.load(), 4 * 2000);
+}
+
+TEST_CASE("test shutil find") {
+  std::string root = "find_root";
+  shutil::remove_dir(root);
+  for (auto dir : {"src", "src/detail", "build", "docs"}) {
+    CHECK(shutil::make_dir(shutil::path_join(root, dir)));
+  }
+  for (auto file : {"src/a.cpp", "src/a.hpp", "src/detail/b.cpp",
+                    "build/a.o", "build/c.cpp", "docs/readme.md", "top.cpp"}) {
+    CHECK(write_file(shutil::path_join(root, file), file));
+  }
+
+  auto files = shutil::find(root, {"*.cpp"}, {"build/"});
+  std::set<std::string> found(files.begin(), files.end());
+  std::set<std::string> expected{shutil::path_join(root, "src/a.cpp"),
+                                 shutil::path_join(root, "src/detail/b.cpp"),
+                                 shutil::path_join(root, "top.cpp")};
+  CHECK_EQ(found, expected);
+
+  CHECK_EQ(shutil::find(root, {}).size(), 11);
+  CHECK_EQ(shutil::find(root, {"src/*"}).size(), 3);
+
+  // copy_tree() skips with the same patterns.
+  shutil::copy_options opts;
+  opts.skip_items = {"build", "*.md", "src/detail/"};
+  auto dest = "find_dest";
+  auto result = shutil::copy_tree(root, dest, opts);
+  CHECK(result.ok());
+  CHECK_EQ(result.files, 3);
+  CHECK(shutil::is_exist(shutil::path_join(dest, "src/a.hpp")));
+  CHECK_FALSE(shutil::is_exist(shutil::path_join(dest, "build")));
+  CHECK_FALSE(shutil::is_exist(shutil::path_join(dest, "src/detail")));
+
+  CHECK(shutil::remove_dir(root));
+  CHECK(shutil::remove_dir(dest));
+}
+
+TEST_CASE("test shutil disk_usage") {
+  std::string root = "usage_root";
+  shutil::remove_dir(root);
+
+  uint64_t bytes = 0;
+  for (int i = 0; i < 3; ++i) {
+    auto dir = shutil::path_join(root, "dir" + std::to_string(i));
+    auto sub = shutil::path_join(dir, "sub");
+    CHECK(shutil::make_dir(sub));
+    for (int j = 0; j < 4; ++j) {
+      std::string content(100 * (j + 1), 'x');
+      CHECK(write_file(shutil::path_join(sub, std::to_string(j)), content));
+      bytes += content.size();
+    }
+  }
+
+  auto usage = shutil::disk_usage(root);
+  CHECK(usage.errors.empty());
+  CHECK_EQ(usage.bytes, bytes);
+  CHECK_EQ(usage.files, 12);
+  CHECK_EQ(usage.dirs, 7);
+  CHECK_GE(usage.allocated, bytes);
+  CHECK_EQ(shutil::get_file_size(root), bytes);
+
+#ifdef __linux__
+  // get_file_size() follows a symlinked directory, disk_usage() does not.
+  std::string link = "usage_link";
+  fs::remove(link);
+  fs::create_directory_symlink(fs::absolute(root), link);
+  CHECK_EQ(shutil::get_file_size(link), bytes);
+  CHECK_EQ(shutil::disk_usage(link).bytes, 0);
+  CHECK(fs::remove(link));
+#endif  // __linux__
+
+  shutil::usage_options opts;
+  opts.threads = 4;
+  auto parallel = shutil::disk_usage(root, opts);
+  CHECK_EQ(parallel.bytes, usage.bytes);
+  CHECK_EQ(parallel.allocated, usage.allocated);
+  CHECK_EQ(parallel.files, usage.files);
+  CHECK_EQ(parallel.dirs, usage.dirs);
+
+#ifdef __linux__
+  SUBCASE("hard links") {
+    auto file = shutil::path_join(root, "dir0/sub/3");
+    fs::create_hard_link(file, shutil::path_join(root, "dir1/link"));
+    fs::create_hard_link(file, shutil::path_join(root, "link"));
+    usage = shutil::disk_usage(root);
+    CHECK_EQ(usage.bytes, bytes);
+    CHECK_EQ(usage.files, 14);
+
+    opts.count_links_once = false;
+    usage = shutil::disk_usage(root, opts);
+    CHECK_EQ(usage.bytes, bytes + 2 * 400);
+  }
+#endif  // __linux__
+
+  SUBCASE("cache") {
+    shutil::usage_cache cache;
+    opts.cache = &cache;
+    usage = shutil::disk_usage(root, opts);
+    CHECK_EQ(usage.bytes, bytes);
+    CHECK_EQ(cache.size(), 7);
+
+    // the cached totals of untouched directories, a new file is seen
+    // through its directory's mtime.
+    usage = shutil::disk_usage(root, opts);
+    CHECK_EQ(usage.bytes, bytes);
+    CHECK_EQ(usage.files, 12);
+
+    CHECK(write_file(shutil::path_join(root, "dir2/sub/new"), "12345"));
+    usage = shutil::disk_usage(root, opts);
+    CHECK_EQ(usage.bytes, bytes + 5);
+    CHECK_EQ(usage.files, 13);
+
+    CHECK(shutil::remove_dir(shutil::path_join(root, "dir1")));
+    usage = shutil::disk_usage(root, opts);
+    CHECK(usage.errors.empty());
+    CHECK_EQ(usage.dirs, 5);
+    CHECK_EQ(usage.files, 9);
+  }
+
+  SUBCASE("missing") {
+    usage = shutil::disk_usage("usage_missing");
+    CHECK_EQ(usage.errors.size(), 1);
+    CHECK_EQ(usage.bytes, 0);
+    CHECK_EQ(shutil::get_file_size("usage_missing"), 0);
+  }
+
+  CHECK(shutil::remove_dir(root));
+}
+
+TEST_CASE("test shutil remove_tree") {
+  std::string root = "remove_root";
+  shutil::remove_dir(root);
+
+  auto make_tree = [&root]() {
+    for (int i = 0; i < 3; ++i) {
+      auto dir = shutil::path_join(root, "dir" + std::to_string(i));
+      auto sub = shutil::path_join(dir, "sub");
+      CHECK(shutil::make_dir(sub));
+      CHECK(shutil::make_dir(shutil::path_join(sub, "empty")));
+      for (int j = 0; j < 4; ++j) {
+        CHECK(write_file(shutil::path_join(dir, std::to_string(j)), "x"));
+        CHECK(write_file(shutil::path_join(sub, std::to_string(j)), "x"));
+      }
+    }
+  };
+
+  make_tree();
+  auto result = shutil::remove_tree(root);
+  CHECK(result.ok());
+  CHECK_FALSE(shutil::is_exist(root));
+  CHECK_EQ(result.files, 24);
+  CHECK_EQ(result.dirs, 10);
+
+  SUBCASE("parallel") {
+    make_tree();
+    shutil::remove_options opts;
+    opts.threads = 4;
+    result = shutil::remove_tree(root, opts);
+    CHECK(result.ok());
+    CHECK_FALSE(shutil::is_exist(root));
+    CHECK_EQ(result.files, 24);
+    CHECK_EQ(result.dirs, 10);
+  }
+
+#ifdef __linux__
+  SUBCASE("symlinks") {
+    std::string keep = "remove_keep";
+    CHECK(shutil::make_dir(keep));
+    CHECK(write_file(shutil::path_join(keep, "file"), "x"));
+
+    for (size_t threads : {0, 4}) {
+      CHECK(shutil::make_dir(shutil::path_join(root, "sub")));
+      fs::create_directory_symlink(fs::absolute(keep),
+                                   shutil::path_join(root, "link"));
+      fs::create_directory_symlink(fs::absolute(keep),
+                                   shutil::path_join(root, "sub/link"));
+
+      shutil::remove_options opts;
+      opts.threads = threads;
+      result = shutil::remove_tree(root, opts);
+      CHECK(result.ok());
+      CHECK_EQ(result.files, 2);
+      CHECK_EQ(result.dirs, 2);
+      CHECK_FALSE(shutil::is_exist(root));
+      CHECK(shutil::is_exist(shutil::path_join(keep, "file")));
+    }
+    CHECK(shutil::remove_dir(keep));
+  }
+#endif  // __linux__
+
+  SUBCASE("later") {
+    std::string trash = "remove_trash";
+    make_tree();
+    auto future = shutil::remove_tree_later(root, trash);
+    // gone from its place once the call returns.
+    CHECK_FALSE(shutil::is_exist(root));
+    result = future.get();
+    CHECK(result.ok());
+    CHECK(shutil::glob(trash).empty());
+    CHECK(shutil::remove_dir(trash));
+
+    result = shutil::remove_tree_later("remove_missing", trash).get();
+    CHECK_FALSE(result.ok());
+    CHECK_EQ(result.errors[0].path, "remove_missing");
+    CHECK(shutil::remove_dir(trash));
+  }
+
+  SUBCASE("missing or file") {
+    CHECK(shutil::remove_tree("remove_missing").ok());
+
+    CHECK(write_file("remove_file", "x"));
+    result = shutil::remove_tree("remove_file");
+    CHECK(result.ok());
+    CHECK_FALSE(shutil::is_exist("remove_file"));
+  }
+
+  CHECK(shutil::remove_dir(root));
+}
+
+TEST_CASE("test shutil mapped_file") {
+  auto split = [](const shutil::record_range& range) {
+    std::vector<std::string> records;
+    for (auto record : range)
+      records.emplace_back(record.data(), record.size());
+    return records;
+  };
+
+  using strings = std::vector<std::string>;
+  CHECK_EQ(split(shutil::record_range("a\nbc\n\nd")),
+           strings{"a", "bc", "", "d"});
+  CHECK_EQ(split(shutil::record_range("a\nb\n")), strings{"a", "b"});
+  CHECK_EQ(split(shutil::record_range("\n")), strings{""});
+  CHECK(split(shutil::record_range("")).empty());
+  CHECK_EQ(split(shutil::record_range("k=v;x", ';')), strings{"k=v", "x"});
+
+  std::string file = "mapped_file.txt";
+  std::string content;
+  strings expected;
+  for (int i = 0; i < 1000; ++i) {
+    expected.push_back("line " + std::to_string(i));
+    content += expected.back() + "\n";
+  }
+  CHECK(write_file(file, content));
+
+  shutil::mapped_file mapped(file);
+  CHECK(mapped.is_open());
+  CHECK_EQ(mapped.size(), content.size());
+  CHECK_EQ(std::string(mapped.data(), mapped.size()), content);
+  CHECK_EQ(split(mapped.lines()), expected);
+#ifdef __linux__
+  CHECK(mapped.mapped());
+#endif  // __linux__
+
+  auto moved = std::move(mapped);
+  CHECK_FALSE(mapped.is_open());
+  CHECK_EQ(moved.view().substr(0, 6), "line 0");
+
+  SUBCASE("empty and missing") {
+    CHECK(write_file(file, ""));
+    CHECK(moved.open(file, shutil::access_hint::random));
+    CHECK_EQ(moved.size(), 0);
+    CHECK(split(moved.lines()).empty());
+
+    CHECK_FALSE(moved.open("mapped_missing.txt"));
+    CHECK(moved.error());
+    CHECK_FALSE(moved.is_open());
+  }
+
+#ifdef __linux__
+  SUBCASE("buffered") {
+    // procfs reports a size of 0, the contents are read instead.
+    shutil::mapped_file status("/proc/self/status");
+    CHECK(status.is_open());
+    CHECK_FALSE(status.mapped());
+    CHECK_GT(status.size(), 0);
+    CHECK_EQ(shutil::record_range(status.view()).begin()->substr(0, 5),
+             "Name:");
+  }
+#endif  // __linux__
+
+  CHECK(shutil::remove_file(file));
+}
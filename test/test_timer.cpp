@@ -0,0 +1,98 @@
+﻿#include <atomic>
+#include <chrono>
+#include <iostream>
+#include <thread>
+#include <vector>
+
+#include "doctest.h"
+#include "timer.hpp"
+using namespace utility;
+
+TEST_CASE("test timer") {
+  using clock = timer::clock;
+
+  timer t;
+  std::atomic_int32_t fired{0};
+  std::vector<int> order;
+  clock::time_point fired_at;
+
+  auto start = clock::now();
+  t.add(std::chrono::milliseconds(30), [&]() {
+    order.push_back(2);
+    fired_at = clock::now();
+    fired.fetch_add(1);
+  });
+  t.add(std::chrono::duration<double, std::milli>(10.5), [&]() {
+    order.push_back(1);
+    fired.fetch_add(1);
+  });
+
+  auto id = t.add(std::chrono::milliseconds(20), [&]() {
+    order.push_back(-1);
+    fired.fetch_add(1);
+  });
+  CHECK_EQ(t.size(), 3);
+  CHECK_EQ(t.cancel(id), true);
+  CHECK_EQ(t.cancel(id), false);
+
+  // far away timers sit on the upper levels of the wheel.
+  auto far = t.add(std::chrono::hours(24), []() {});
+  CHECK_EQ(t.size(), 3);
+
+  while (fired.load() < 2 && clock::now() - start < std::chrono::seconds(5)) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  }
+
+  CHECK_EQ(order, std::vector<int>{1, 2});
+  CHECK_GE(fired_at - start, std::chrono::milliseconds(30));
+  CHECK_EQ(t.cancel(far), true);
+  CHECK_EQ(t.size(), 0);
+}
+
+TEST_CASE("test timer cascade") {
+  // 1us ticks: 300ms spans several wheel levels.
+  timer t(nullptr, std::chrono::microseconds(1));
+  std::atomic_int32_t fired{0};
+
+  auto start = timer::clock::now();
+  for (int ms : {300, 1, 70, 5, 150}) {
+    t.add(std::chrono::milliseconds(ms), [&fired]() {
+      fired.fetch_add(1);
+    });
+  }
+
+  while (fired.load() < 5 &&
+         timer::clock::now() - start < std::chrono::seconds(5)) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  }
+  CHECK_EQ(fired.load(), 5);
+}
+
+TEST_CASE("test timer dispatch_to") {
+  event_queue_options opts;
+  opts.drain_on_stop = true;
+
+  function_queue fq(opts);
+  event_queue eq(opts);
+  std::thread::id fq_thread;
+  std::thread::id eq_thread;
+
+  {
+    timer to_fq(dispatch_to(fq));
+    timer to_eq(dispatch_to(eq));
+    to_fq.add(std::chrono::milliseconds(1), [&]() {
+      fq_thread = std::this_thread::get_id();
+      fq.stop();
+    });
+    to_eq.add(std::chrono::milliseconds(1), [&]() {
+      eq_thread = std::this_thread::get_id();
+      eq.stop();
+    });
+
+    fq.loop();
+    eq.loop();
+  }
+
+  CHECK(fq_thread == std::this_thread::get_id());
+  CHECK(eq_thread == std::this_thread::get_id());
+}
@@ -0,0 +1,386 @@
+﻿/*
+
+Copyright (c) 2024 lemon19900815@buerjia
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+
+*/
+
+#ifndef __UTILITY_COROUTINE_HPP__
+#define __UTILITY_COROUTINE_HPP__
+
+#include "event_queue.hpp"
+
+// c++20 only, empty otherwise.
+#if __cplusplus >= 202002L && defined(__cpp_impl_coroutine)
+
+#include <condition_variable>
+#include <coroutine>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <stdexcept>
+#include <type_traits>
+#include <utility>
+
+namespace utility {
+
+// coroutines on top of event_queue:
+//   task<int> step(function_queue &fq) {
+//     co_await coro::schedule(fq);  // continue on fq's consumer thread
+//     co_return 42;
+//   }
+namespace coro {
+
+// co_await schedule(eq) throws it when eq did not run the continuation:
+// the enqueue was rejected, or stop() without drain_on_stop dropped it.
+class operation_cancelled : public std::runtime_error {
+ public:
+  operation_cancelled() : std::runtime_error("operation cancelled") {}
+};
+
+namespace detail {
+
+// the coroutine this thread is enqueueing: its event destroyed meanwhile
+// was rejected, await_suspend() resumes it, not the event.
+inline std::coroutine_handle<> &enqueuing() {
+  thread_local std::coroutine_handle<> handle;
+  return handle;
+}
+
+}  // namespace detail
+
+// a queued continuation: fits inline_event's buffer and can be the value
+// event of a basic_event_queue itself, so resuming does not allocate.
+// one the queue drops without running it sets cancelled first and then
+// resumes where it is destroyed, so the frame is not leaked and the
+// co_await throws operation_cancelled instead of going on.
+class resume_event {
+ public:
+  resume_event() = default;
+  explicit resume_event(std::coroutine_handle<> handle,
+                        bool *cancelled = nullptr)
+      : handle_(handle), cancelled_(cancelled) {}
+
+  resume_event(resume_event &&other) noexcept
+      : handle_(std::exchange(other.handle_, {})),
+        cancelled_(other.cancelled_) {}
+
+  resume_event &operator=(resume_event &&other) noexcept {
+    if (this != &other) {
+      drop();
+      handle_ = std::exchange(other.handle_, {});
+      cancelled_ = other.cancelled_;
+    }
+    return *this;
+  }
+
+  ~resume_event() { drop(); }
+
+  void operator()() { resume(); }
+  void process() { resume(); }
+
+ private:
+  void resume() {
+    if (handle_)
+      std::exchange(handle_, {}).resume();
+  }
+
+  void drop() {
+    if (!handle_)
+      return;
+
+    if (cancelled_)
+      *cancelled_ = true;
+    if (handle_ == detail::enqueuing())
+      handle_ = {};
+    else
+      resume();
+  }
+
+  std::coroutine_handle<> handle_;
+  bool *cancelled_{nullptr};
+};
+
+// event_handler::ptr queues pay one allocation per resume.
+class resume_handler : public event_handler {
+ public:
+  resume_handler(std::coroutine_handle<> handle, bool *cancelled)
+      : ev_(handle, cancelled) {}
+
+  virtual void process() override { ev_.process(); }
+
+ private:
+  resume_event ev_;
+};
+
+template <typename EventQueue>
+class schedule_awaitable {
+ public:
+  schedule_awaitable(EventQueue &eq, event_priority priority)
+      : eq_(eq), priority_(priority) {}
+
+  bool await_ready() const noexcept { return false; }
+
+  // the coroutine may run on the queue before enqueue() returns, so the
+  // awaitable must not be touched once it was accepted. a rejected one
+  // (stop() while blocked, or a full queue with overflow_policy::fail)
+  // resumes on this thread and throws operation_cancelled.
+  bool await_suspend(std::coroutine_handle<> handle) {
+    using event_type = typename EventQueue::event_type;
+
+    auto outer = std::exchange(detail::enqueuing(), handle);
+    bool queued;
+    if constexpr (std::is_same_v<event_type, event_handler::ptr>)
+      queued = eq_.enqueue(std::make_shared<resume_handler>(handle,
+                                                            &cancelled_),
+                           priority_);
+    else
+      queued = eq_.enqueue(event_type(resume_event(handle, &cancelled_)),
+                           priority_);
+    detail::enqueuing() = outer;
+
+    if (!queued)
+      cancelled_ = true;
+    return queued;
+  }
+
+  void await_resume() const {
+    if (cancelled_)
+      throw operation_cancelled();
+  }
+
+ private:
+  EventQueue &eq_;
+  event_priority priority_;
+  bool cancelled_{false};
+};
+
+// co_await schedule(eq): continue on a consumer thread of eq.
+template <typename EventQueue>
+schedule_awaitable<EventQueue> schedule(
+    EventQueue &eq, event_priority priority = event_priority::normal) {
+  return schedule_awaitable<EventQueue>(eq, priority);
+}
+
+template <typename T = void>
+class task;
+
+namespace detail {
+
+class promise_base {
+ public:
+  std::suspend_always initial_suspend() const noexcept { return {}; }
+
+  // symmetric transfer to the awaiting coroutine, no stack growth.
+  struct final_awaiter {
+    bool await_ready() const noexcept { return false; }
+
+    template <typename Promise>
+    std::coroutine_handle<> await_suspend(
+        std::coroutine_handle<Promise> handle) noexcept {
+      return handle.promise().continuation_;
+    }
+
+    void await_resume() const noexcept {}
+  };
+
+  final_awaiter final_suspend() const noexcept { return {}; }
+
+  void unhandled_exception() noexcept { error_ = std::current_exception(); }
+
+  void set_continuation(std::coroutine_handle<> continuation) noexcept {
+    continuation_ = continuation;
+  }
+
+ protected:
+  void rethrow_if_error() {
+    if (error_)
+      std::rethrow_exception(error_);
+  }
+
+ private:
+  std::coroutine_handle<> continuation_{std::noop_coroutine()};
+  std::exception_ptr error_;
+};
+
+template <typename T>
+class promise : public promise_base {
+ public:
+  task<T> get_return_object() noexcept;
+
+  template <typename U>
+  void return_value(U &&value) {
+    value_.emplace(std::forward<U>(value));
+  }
+
+  T result() {
+    rethrow_if_error();
+    return std::move(*value_);
+  }
+
+ private:
+  std::optional<T> value_;
+};
+
+template <>
+class promise<void> : public promise_base {
+ public:
+  task<void> get_return_object() noexcept;
+
+  void return_void() noexcept {}
+
+  void result() { rethrow_if_error(); }
+};
+
+// fire-and-forget coroutine, its frame frees itself at the end.
+struct detached {
+  struct promise_type {
+    detached get_return_object() const noexcept { return {}; }
+    std::suspend_never initial_suspend() const noexcept { return {}; }
+    std::suspend_never final_suspend() const noexcept { return {}; }
+    void return_void() const noexcept {}
+    void unhandled_exception() const noexcept { std::terminate(); }
+  };
+};
+
+}  // namespace detail
+
+// lazy coroutine: starts when awaited, hands its result or exception to
+// the awaiting coroutine and resumes it where the task finished.
+template <typename T>
+class task {
+ public:
+  using promise_type = detail::promise<T>;
+  using handle_type = std::coroutine_handle<promise_type>;
+
+  task() = default;
+  explicit task(handle_type handle) : handle_(handle) {}
+
+  task(task &&other) noexcept : handle_(std::exchange(other.handle_, {})) {}
+
+  task &operator=(task &&other) noexcept {
+    if (this != &other) {
+      if (handle_)
+        handle_.destroy();
+      handle_ = std::exchange(other.handle_, {});
+    }
+    return *this;
+  }
+
+  task(const task &) = delete;
+  task &operator=(const task &) = delete;
+
+  ~task() {
+    if (handle_)
+      handle_.destroy();
+  }
+
+  bool valid() const { return static_cast<bool>(handle_); }
+
+  auto operator co_await() && noexcept {
+    struct awaiter {
+      handle_type handle;
+
+      bool await_ready() const noexcept { return !handle || handle.done(); }
+
+      std::coroutine_handle<> await_suspend(
+          std::coroutine_handle<> continuation) noexcept {
+        handle.promise().set_continuation(continuation);
+        return handle;
+      }
+
+      T await_resume() { return handle.promise().result(); }
+    };
+
+    return awaiter{handle_};
+  }
+
+ private:
+  handle_type handle_;
+};
+
+namespace detail {
+
+template <typename T>
+task<T> promise<T>::get_return_object() noexcept {
+  return task<T>(std::coroutine_handle<promise<T>>::from_promise(*this));
+}
+
+inline task<void> promise<void>::get_return_object() noexcept {
+  return task<void>(std::coroutine_handle<promise<void>>::from_promise(*this));
+}
+
+}  // namespace detail
+
+// run a task without waiting for it, an escaping exception terminates.
+inline void spawn(task<void> t) {
+  [](task<void> t) -> detail::detached {
+    co_await std::move(t);
+  }(std::move(t));
+}
+
+// block the calling thread until the task finished. the task must not need
+// this thread, e.g. to run the loop() of a queue it schedules onto. a
+// continuation the queue rejected or dropped throws operation_cancelled.
+template <typename T>
+T sync_wait(task<T> t) {
+  std::mutex mtx;
+  std::condition_variable cv;
+  bool done = false;
+  std::optional<std::conditional_t<std::is_void_v<T>, int, T>> value;
+  std::exception_ptr error;
+
+  auto run = [&](task<T> t) -> detail::detached {
+    try {
+      if constexpr (std::is_void_v<T>)
+        co_await std::move(t);
+      else
+        value.emplace(co_await std::move(t));
+    }
+    catch (...) {
+      error = std::current_exception();
+    }
+
+    std::lock_guard<std::mutex> guard(mtx);
+    done = true;
+    cv.notify_one();
+  };
+  run(std::move(t));
+
+  std::unique_lock<std::mutex> lock(mtx);
+  cv.wait(lock, [&done]() {
+    return done;
+  });
+
+  if (error)
+    std::rethrow_exception(error);
+
+  if constexpr (!std::is_void_v<T>)
+    return std::move(*value);
+}
+
+}  // namespace coro
+
+}  // namespace utility
+
+#endif  // __cplusplus >= 202002L && defined(__cpp_impl_coroutine)
+
+#endif  // __UTILITY_COROUTINE_HPP__
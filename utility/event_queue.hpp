@@ -25,12 +25,28 @@ THE SOFTWARE.
 #ifndef __UTILITY_EVENT_QUEUE_HPP__
 #define __UTILITY_EVENT_QUEUE_HPP__
 
+#include <algorithm>
 #include <atomic>
+#include <chrono>
 #include <condition_variable>
+#include <cstddef>
+#include <cstdint>
 #include <deque>
 #include <functional>
+#include <iterator>
+#include <limits>
+#include <map>
+#include <memory>
 #include <mutex>
+#include <new>
+#include <string>
 #include <thread>
+#include <type_traits>
+#include <typeindex>
+#include <typeinfo>
+#include <unordered_map>
+#include <utility>
+#include <vector>
 
 #define USING_PTR(Type)              \
   using ptr = std::shared_ptr<Type>; \
@@ -45,62 +61,1483 @@ class event_handler {
   virtual void process() = 0;
 };
 
-class event_queue final {
+// move-only void() callable stored inline when it fits kInlineSize, so
+// queueing a lambda or a coroutine handle does not allocate.
+class inline_event {
  public:
-  ~event_queue() { stop(); }
+  static constexpr size_t kInlineSize = 48;
 
-  void enqueue(event_handler::ptr ev_handler) {
+  inline_event() = default;
+
+  template <typename F, typename Fn = typename std::decay<F>::type,
+            typename = typename std::enable_if<
+                !std::is_same<Fn, inline_event>::value>::type>
+  inline_event(F &&f) {
+    construct<Fn>(std::forward<F>(f), stored_inline<Fn>());
+  }
+
+  inline_event(inline_event &&other) noexcept { move_from(other); }
+
+  inline_event &operator=(inline_event &&other) noexcept {
+    if (this != &other) {
+      reset();
+      move_from(other);
+    }
+    return *this;
+  }
+
+  inline_event(const inline_event &) = delete;
+  inline_event &operator=(const inline_event &) = delete;
+
+  ~inline_event() { reset(); }
+
+  explicit operator bool() const { return ops_ != nullptr; }
+
+  void operator()() {
+    if (ops_)
+      ops_->invoke(&buf_);
+  }
+
+  // like std::function::target_type(), typeid(void) when empty.
+  const std::type_info &target_type() const {
+    return ops_ ? ops_->type() : typeid(void);
+  }
+
+ private:
+  struct ops {
+    void (*invoke)(void *buf);
+    void (*move)(void *dst, void *src);
+    void (*destroy)(void *buf);
+    const std::type_info &(*type)();
+  };
+
+  template <typename Fn>
+  static const std::type_info &type_of() {
+    return typeid(Fn);
+  }
+
+  template <typename Fn>
+  using stored_inline = std::integral_constant<
+      bool, sizeof(Fn) <= kInlineSize &&
+                alignof(Fn) <= alignof(std::max_align_t) &&
+                std::is_nothrow_move_constructible<Fn>::value>;
+
+  template <typename Fn>
+  struct inline_ops {
+    static void invoke(void *buf) { (*static_cast<Fn *>(buf))(); }
+    static void move(void *dst, void *src) {
+      new (dst) Fn(std::move(*static_cast<Fn *>(src)));
+      static_cast<Fn *>(src)->~Fn();
+    }
+    static void destroy(void *buf) { static_cast<Fn *>(buf)->~Fn(); }
+    static const ops table;
+  };
+
+  // too big for the buffer: keep the callable on the heap.
+  template <typename Fn>
+  struct heap_ops {
+    static Fn *&get(void *buf) { return *static_cast<Fn **>(buf); }
+    static void invoke(void *buf) { (*get(buf))(); }
+    static void move(void *dst, void *src) {
+      new (dst) Fn *(get(src));
+      get(src) = nullptr;
+    }
+    static void destroy(void *buf) { delete get(buf); }
+    static const ops table;
+  };
+
+  template <typename Fn, typename F>
+  void construct(F &&f, std::true_type) {
+    new (&buf_) Fn(std::forward<F>(f));
+    ops_ = &inline_ops<Fn>::table;
+  }
+
+  template <typename Fn, typename F>
+  void construct(F &&f, std::false_type) {
+    new (&buf_) Fn *(new Fn(std::forward<F>(f)));
+    ops_ = &heap_ops<Fn>::table;
+  }
+
+  void move_from(inline_event &other) {
+    if (other.ops_) {
+      other.ops_->move(&buf_, &other.buf_);
+      ops_ = other.ops_;
+      other.ops_ = nullptr;
+    }
+  }
+
+  void reset() {
+    if (ops_) {
+      ops_->destroy(&buf_);
+      ops_ = nullptr;
+    }
+  }
+
+  typename std::aligned_storage<kInlineSize, alignof(std::max_align_t)>::type
+      buf_;
+  const ops *ops_{nullptr};
+};
+
+template <typename Fn>
+const inline_event::ops inline_event::inline_ops<Fn>::table = {
+    &inline_event::inline_ops<Fn>::invoke, &inline_event::inline_ops<Fn>::move,
+    &inline_event::inline_ops<Fn>::destroy, &inline_event::type_of<Fn>};
+
+template <typename Fn>
+const inline_event::ops inline_event::heap_ops<Fn>::table = {
+    &inline_event::heap_ops<Fn>::invoke, &inline_event::heap_ops<Fn>::move,
+    &inline_event::heap_ops<Fn>::destroy, &inline_event::type_of<Fn>};
+
+namespace detail {
+
+// how a queued event is processed, picked at compile time:
+// ev->process() for handler pointers, ev.process() for value events with a
+// (non-virtual) process member, ev() for callables.
+template <typename Event>
+auto process_event(Event &ev, int) -> decltype(ev->process(), void()) {
+  if (ev)
+    ev->process();
+}
+
+template <typename Event>
+auto process_event(Event &ev, long) -> decltype(ev.process(), void()) {
+  ev.process();
+}
+
+template <typename Event>
+auto process_event(Event &ev, ...) -> decltype(ev(), void()) {
+  ev();
+}
+
+// the handler type metrics are kept for: the dynamic type behind a handler
+// pointer, the callable inside an inline_event, Event itself otherwise.
+template <typename Event>
+auto event_type_of(const Event &ev, int)
+    -> decltype(void(ev->process()), std::declval<const std::type_info &>()) {
+  return ev ? typeid(*ev) : typeid(void);
+}
+
+template <typename Event>
+auto event_type_of(const Event &ev, long)
+    -> decltype(void(ev.target_type()),
+                std::declval<const std::type_info &>()) {
+  return ev.target_type();
+}
+
+template <typename Event>
+const std::type_info &event_type_of(const Event &, ...) {
+  return typeid(Event);
+}
+
+// what a lane slot holds: the event and when it was queued (0 unless
+// event_queue_options::metrics).
+template <typename Event>
+struct queued_event {
+  Event ev;
+  uint64_t enqueued_ns;
+};
+
+// the slots of a bounded backend, 0 for an unbounded one.
+template <typename Queue>
+auto queue_capacity(const Queue &queue, int) -> decltype(queue.capacity()) {
+  return queue.capacity();
+}
+
+template <typename Queue>
+size_t queue_capacity(const Queue &, long) {
+  return 0;
+}
+
+// std::chrono::ceil() before c++17: floating-point delays included, which
+// do not add to a time_point of the clock's own duration.
+template <typename To, typename Rep, typename Period>
+To ceil_duration(std::chrono::duration<Rep, Period> d) {
+  auto t = std::chrono::duration_cast<To>(d);
+  if (t < d)
+    t += To(1);
+  return t;
+}
+
+// the same backend holding queued_event instead of Event.
+template <typename Queue, typename T>
+struct rebind_queue;
+
+template <template <typename> class Queue, typename Event, typename T>
+struct rebind_queue<Queue<Event>, T> {
+  using type = Queue<T>;
+};
+
+// copies events out of a range into queued_event slots.
+template <typename Iter, typename Event>
+class stamp_iterator {
+ public:
+  using iterator_category = std::input_iterator_tag;
+  using value_type = queued_event<Event>;
+  using difference_type = std::ptrdiff_t;
+  using pointer = const value_type *;
+  using reference = value_type;
+
+  stamp_iterator(Iter it, uint64_t stamp) : it_(it), stamp_(stamp) {}
+
+  value_type operator*() const { return value_type{*it_, stamp_}; }
+
+  stamp_iterator &operator++() {
+    ++it_;
+    return *this;
+  }
+
+  stamp_iterator operator++(int) {
+    auto prev = *this;
+    ++it_;
+    return prev;
+  }
+
+  bool operator==(const stamp_iterator &other) const {
+    return it_ == other.it_;
+  }
+
+  bool operator!=(const stamp_iterator &other) const {
+    return it_ != other.it_;
+  }
+
+ private:
+  Iter it_;
+  uint64_t stamp_;
+};
+
+}  // namespace detail
+
+// unbounded FIFO guarded by a mutex, any number of producers and consumers.
+template <typename T>
+class locked_queue {
+ public:
+  explicit locked_queue(size_t /*capacity*/ = 0) {}
+
+  bool push(T &value) {
     std::lock_guard<std::mutex> guard(mtx_);
-    queue_.emplace_back(std::move(ev_handler));
-    cv_.notify_one();
+    queue_.emplace_back(std::move(value));
+    return true;
+  }
+
+  template <typename Iter>
+  size_t push_bulk(Iter first, Iter last) {
+    std::lock_guard<std::mutex> guard(mtx_);
+    auto size = queue_.size();
+    queue_.insert(queue_.end(), first, last);
+    return queue_.size() - size;
+  }
+
+  bool pop(T &value) {
+    std::lock_guard<std::mutex> guard(mtx_);
+    if (queue_.empty())
+      return false;
+
+    value = std::move(queue_.front());
+    queue_.pop_front();
+    return true;
+  }
+
+  // append up to max events to out, the whole pending batch is swapped out
+  // when it fits.
+  size_t pop_bulk(std::deque<T> &out, size_t max) {
+    std::lock_guard<std::mutex> guard(mtx_);
+    if (out.empty() && queue_.size() <= max) {
+      out.swap(queue_);
+      return out.size();
+    }
+
+    auto count = std::min(queue_.size(), max);
+    for (size_t i = 0; i < count; ++i) {
+      out.emplace_back(std::move(queue_.front()));
+      queue_.pop_front();
+    }
+    return count;
+  }
+
+  bool empty() {
+    std::lock_guard<std::mutex> guard(mtx_);
+    return queue_.empty();
+  }
+
+  size_t size() {
+    std::lock_guard<std::mutex> guard(mtx_);
+    return queue_.size();
+  }
+
+  // the events are destroyed after the lock is released.
+  void clear() {
+    std::deque<T> dropped;
+    std::lock_guard<std::mutex> guard(mtx_);
+    queue_.swap(dropped);
+  }
+
+ private:
+  std::mutex mtx_;
+  std::deque<T> queue_;
+};
+
+// bounded lock-free ring: many producers, a single consumer at a time.
+// every slot carries a sequence number telling whether it is free for the
+// producer of lap N or filled for the consumer of lap N (D. Vyukov).
+template <typename T>
+class mpsc_ring_queue {
+ public:
+  static constexpr size_t kDefaultCapacity = 8192;
+
+  explicit mpsc_ring_queue(size_t capacity = kDefaultCapacity) {
+    if (capacity == 0)
+      capacity = kDefaultCapacity;
+
+    size_t size = 2;
+    while (size < capacity)
+      size <<= 1;
+
+    mask_ = size - 1;
+    cells_.reset(new cell[size]);
+    for (size_t i = 0; i < size; ++i)
+      cells_[i].seq.store(i, std::memory_order_relaxed);
+  }
+
+  // false if the ring is full, value is left untouched then.
+  bool push(T &value) {
+    size_t pos = 0;
+    auto c = claim(pos);
+    if (!c)
+      return false;
+
+    c->value = std::move(value);
+    c->seq.store(pos + 1, std::memory_order_release);
+    return true;
+  }
+
+  // stops at the first event that does not fit, returns the pushed count.
+  template <typename Iter>
+  size_t push_bulk(Iter first, Iter last) {
+    size_t count = 0;
+    for (; first != last; ++first, ++count) {
+      size_t pos = 0;
+      auto c = claim(pos);
+      if (!c)
+        break;
+
+      c->value = *first;
+      c->seq.store(pos + 1, std::memory_order_release);
+    }
+    return count;
+  }
+
+  // consumer only.
+  bool pop(T &value) {
+    auto pos = head_.load(std::memory_order_relaxed);
+    auto &c = cells_[pos & mask_];
+    if (c.seq.load(std::memory_order_acquire) != pos + 1)
+      return false;
+
+    value = std::move(c.value);
+    c.seq.store(pos + mask_ + 1, std::memory_order_release);
+    head_.store(pos + 1, std::memory_order_relaxed);
+    return true;
+  }
+
+  // consumer only.
+  size_t pop_bulk(std::deque<T> &out, size_t max) {
+    size_t count = 0;
+    T value;
+    while (count < max && pop(value)) {
+      out.emplace_back(std::move(value));
+      ++count;
+    }
+    return count;
+  }
+
+  bool empty() {
+    auto pos = head_.load(std::memory_order_relaxed);
+    return cells_[pos & mask_].seq.load(std::memory_order_acquire) != pos + 1;
+  }
+
+  size_t size() {
+    auto head = head_.load(std::memory_order_relaxed);
+    auto tail = tail_.load(std::memory_order_relaxed);
+    return tail > head ? tail - head : 0;
+  }
+
+  size_t capacity() const { return mask_ + 1; }
+
+  // consumer only.
+  void clear() {
+    T value;
+    while (pop(value)) {
+    }
+  }
+
+ private:
+  struct cell {
+    std::atomic<size_t> seq;
+    T value;
+  };
+
+  static constexpr size_t kCacheLine = 64;
+
+  // reserve the next free slot for this producer, nullptr if full.
+  cell *claim(size_t &pos) {
+    pos = tail_.load(std::memory_order_relaxed);
+
+    while (true) {
+      auto c = &cells_[pos & mask_];
+      auto seq = c->seq.load(std::memory_order_acquire);
+      auto diff = static_cast<intptr_t>(seq) - static_cast<intptr_t>(pos);
+
+      if (diff == 0) {
+        if (tail_.compare_exchange_weak(pos, pos + 1,
+                                        std::memory_order_relaxed))
+          return c;
+      }
+      else if (diff < 0) {
+        return nullptr;
+      }
+      else {
+        pos = tail_.load(std::memory_order_relaxed);
+      }
+    }
+  }
+
+  size_t mask_{0};
+  std::unique_ptr<cell[]> cells_;
+
+  // keep the producers' and the consumer's index on their own cache line.
+  char pad0_[kCacheLine];
+  std::atomic<size_t> tail_{0};
+  char pad1_[kCacheLine - sizeof(std::atomic<size_t>)];
+  std::atomic<size_t> head_{0};
+  char pad2_[kCacheLine - sizeof(std::atomic<size_t>)];
+};
+
+// every priority is a lane of its own, so enqueue stays O(1) and a control
+// event never waits behind the bulk work of a lower lane.
+enum class event_priority : size_t { high = 0, normal = 1, low = 2 };
+
+// what enqueue() does when the queue holds capacity events.
+enum class overflow_policy {
+  block,        // wait until a consumer made room.
+  fail,         // reject the new event.
+  drop_oldest,  // drop the oldest event of the lowest non-empty priority.
+};
+
+// lock-free latency histogram in nanoseconds with log-linear buckets (HDR
+// style): 16 sub-buckets per power of two, so a value is reported at most
+// 1/16 too high. values from 2^40ns (~18min) on share the last bucket.
+class latency_histogram {
+ public:
+  static constexpr size_t kSubBits = 4;
+  static constexpr size_t kSubCount = size_t(1) << kSubBits;
+  static constexpr size_t kMaxBits = 40;
+  static constexpr size_t kBucketCount =
+      kSubCount + (kMaxBits - kSubBits) * kSubCount;
+
+  struct summary {
+    uint64_t count{0};
+    uint64_t sum{0};
+    uint64_t max{0};
+    std::vector<uint64_t> buckets;
+
+    double mean() const {
+      return count ? static_cast<double>(sum) / count : 0.0;
+    }
+
+    // upper bound of the bucket holding the q quantile (0 <= q <= 1).
+    uint64_t percentile(double q) const {
+      if (count == 0)
+        return 0;
+
+      auto rank = static_cast<uint64_t>(q * (count - 1)) + 1;
+      uint64_t seen = 0;
+      for (size_t i = 0; i < buckets.size(); ++i) {
+        seen += buckets[i];
+        if (seen >= rank)
+          return std::min(upper_bound(i), max);
+      }
+      return max;
+    }
+  };
+
+  latency_histogram() {
+    for (auto &b : buckets_)
+      b.store(0, std::memory_order_relaxed);
+  }
+
+  void record(uint64_t ns) {
+    buckets_[bucket_of(ns)].fetch_add(1, std::memory_order_relaxed);
+    sum_.fetch_add(ns, std::memory_order_relaxed);
+
+    auto max = max_.load(std::memory_order_relaxed);
+    while (ns > max &&
+           !max_.compare_exchange_weak(max, ns, std::memory_order_relaxed)) {
+    }
+  }
+
+  // concurrent record() calls may be half visible.
+  summary snapshot() const {
+    summary s;
+    s.buckets.resize(kBucketCount);
+    for (size_t i = 0; i < kBucketCount; ++i) {
+      s.buckets[i] = buckets_[i].load(std::memory_order_relaxed);
+      s.count += s.buckets[i];
+    }
+    s.sum = sum_.load(std::memory_order_relaxed);
+    s.max = max_.load(std::memory_order_relaxed);
+    return s;
+  }
+
+  static size_t bucket_of(uint64_t ns) {
+    if (ns < kSubCount)
+      return static_cast<size_t>(ns);
+
+    auto bits = msb(ns);
+    if (bits >= kMaxBits)
+      return kBucketCount - 1;
+
+    auto shift = bits - kSubBits;
+    auto sub = static_cast<size_t>(ns >> shift) & (kSubCount - 1);
+    return kSubCount + shift * kSubCount + sub;
+  }
+
+  // the largest value counted in bucket i.
+  static uint64_t upper_bound(size_t i) {
+    if (i < kSubCount)
+      return i;
+
+    auto shift = (i - kSubCount) / kSubCount;
+    auto sub = (i - kSubCount) % kSubCount;
+    return ((kSubCount + sub + 1) << shift) - 1;
+  }
+
+ private:
+  static size_t msb(uint64_t v) {
+#if defined(__GNUC__) || defined(__clang__)
+    return 63 - static_cast<size_t>(__builtin_clzll(v));
+#else
+    size_t n = 0;
+    while (v >>= 1)
+      ++n;
+    return n;
+#endif
+  }
+
+  std::atomic<uint64_t> buckets_[kBucketCount];
+  std::atomic<uint64_t> sum_{0};
+  std::atomic<uint64_t> max_{0};
+};
+
+// basic_event_queue::stats(), all zero unless event_queue_options::metrics.
+struct event_queue_stats {
+  // events waiting in the lanes and in the workers' local deques.
+  size_t depth{0};
+  // highest depth of the lanes seen by an enqueue.
+  size_t peak_depth{0};
+
+  // enqueue (or a delayed event firing) until its process() starts.
+  latency_histogram::summary wait;
+  // process() of every event.
+  latency_histogram::summary process;
+
+  // process() per handler type, the slowest in total first.
+  struct handler_stats {
+    std::string type;
+    latency_histogram::summary process;
+  };
+  std::vector<handler_stats> handlers;
+};
+
+struct event_queue_options {
+  // 0: the owner drives the queue by calling loop() on its own thread.
+  // N: pool mode, N worker threads owned by the queue drain it together.
+  size_t thread_count{0};
+
+  // stop() lets the consumers finish all pending events instead of dropping
+  // them.
+  bool drain_on_stop{false};
+
+  // pending events the queue holds at most, 0 for unbounded. a bounded
+  // backend such as mpsc_ring_queue then uses its default slot count, and
+  // the overflow policy applies once the slots are taken.
+  size_t capacity{0};
+  overflow_policy overflow{overflow_policy::block};
+
+  // on_watermark(depth, true) once the depth reaches high_watermark,
+  // on_watermark(depth, false) once it is back at low_watermark. called on
+  // the producer or consumer thread that crossed the mark, 0 disables it.
+  size_t high_watermark{0};
+  size_t low_watermark{0};
+  std::function<void(size_t depth, bool high)> on_watermark;
+
+  // events a consumer takes out of the queue at once, bounds the latency a
+  // batch adds to the events behind it.
+  size_t max_batch_size{256};
+
+  // a non-empty lower priority lane is served once it has been passed over
+  // for this many batches, 0 for strict priority.
+  size_t starvation_limit{8};
+
+  // collect the numbers behind stats(): two clock reads per event and a
+  // handful of relaxed atomics. off, a slot only carries an unused stamp.
+  bool metrics{false};
+};
+
+// Event is what the queue slots hold by value: event_handler::ptr for the
+// classic virtual handlers, inline_event for callables, or any movable type
+// with a process() member.
+// Queue is the storage backend of each priority lane: locked_queue or
+// mpsc_ring_queue, rebound to hold the event with its enqueue stamp.
+// enqueue() never takes a lock of its own, the consumers spin briefly and
+// then park on a condition variable that producers only signal when a
+// consumer is actually parked.
+//
+// pool mode: every worker keeps a local deque filled in batches from the
+// shared queue, idle workers steal half of a busy worker's local deque.
+// events are no longer processed in strict FIFO order across workers.
+template <typename Event, typename Queue = locked_queue<Event>>
+class basic_event_queue final {
+ public:
+  using event_type = Event;
+  using clock = std::chrono::steady_clock;
+  using timer_id = uint64_t;
+
+  basic_event_queue() : basic_event_queue(event_queue_options{}) {}
+
+  explicit basic_event_queue(const event_queue_options &opts) : opts_(opts) {
+    for (auto &lane : lanes_)
+      lane.reset(new lane_type(opts_.capacity));
+
+    capacity_ = opts_.capacity;
+    if (capacity_ == 0)
+      capacity_ = detail::queue_capacity(*lanes_[0], 0);
+
+    for (size_t i = 0; i < opts_.thread_count; ++i)
+      workers_.emplace_back(new worker());
+
+    for (size_t i = 0; i < workers_.size(); ++i)
+      workers_[i]->thread =
+          std::thread(&basic_event_queue::worker_loop, this, i);
+  }
+
+  // the events still queued are dropped while the queue is intact.
+  ~basic_event_queue() {
+    stop();
+    clear();
+  }
+
+  // a full queue applies the overflow policy, false if the event was
+  // rejected (overflow_policy::fail, or stop() while blocked).
+  bool enqueue(Event ev, event_priority priority = event_priority::normal) {
+    if (!acquire(true))
+      return false;
+
+    return push(ev, priority);
+  }
+
+  // like enqueue(), but never blocks: false when full unless the policy is
+  // overflow_policy::drop_oldest.
+  bool try_enqueue(Event ev,
+                   event_priority priority = event_priority::normal) {
+    if (!acquire(false))
+      return false;
+
+    return push(ev, priority);
+  }
+
+  // forward iterators. returns how many events were queued, fewer than the
+  // range holds only with overflow_policy::fail or after stop().
+  template <typename Iter>
+  size_t enqueue_bulk(Iter first, Iter last,
+                      event_priority priority = event_priority::normal) {
+    using stamped = detail::stamp_iterator<Iter, Event>;
+
+    auto &lane = *lanes_[static_cast<size_t>(priority)];
+    auto remaining = static_cast<size_t>(std::distance(first, last));
+    size_t total = 0;
+
+    while (remaining > 0) {
+      auto count = acquire_bulk(remaining);
+      if (count == 0) {
+        if (!acquire(true))
+          break;
+        count = 1;
+      }
+
+      auto stamp = now_stamp();
+      auto mid = std::next(first, count);
+      size_t pushed = 0;
+      while (pushed < count) {
+        auto n = lane.push_bulk(stamped(first, stamp), stamped(mid, stamp));
+        std::advance(first, n);
+        pushed += n;
+
+        if (n == 0) {
+          if (stop_.load())
+            break;
+          std::this_thread::yield();
+        }
+      }
+
+      release(count - pushed);
+      remaining -= pushed;
+      total += pushed;
+      wake_one();
+      if (pushed < count)
+        break;
+    }
+
+    return total;
+  }
+
+  template <typename Range>
+  size_t enqueue_bulk(const Range &events,
+                      event_priority priority = event_priority::normal) {
+    return enqueue_bulk(std::begin(events), std::end(events), priority);
+  }
+
+  // the event is queued once the delay expired. the consumers wait_until
+  // the earliest deadline, no timer thread is involved.
+  template <typename Rep, typename Period>
+  timer_id enqueue_after(std::chrono::duration<Rep, Period> delay, Event ev,
+                         event_priority priority = event_priority::normal) {
+    return add_timer(
+        clock::now() + detail::ceil_duration<clock::duration>(delay),
+        clock::duration::zero(), std::move(ev), priority);
+  }
+
+  // a copy of the event is queued every period until cancel().
+  template <typename Rep, typename Period>
+  timer_id enqueue_every(std::chrono::duration<Rep, Period> period, Event ev,
+                         event_priority priority = event_priority::normal) {
+    static_assert(std::is_copy_constructible<Event>::value,
+                  "enqueue_every() queues a copy of the event each period");
+
+    auto interval = detail::ceil_duration<clock::duration>(period);
+    if (interval <= clock::duration::zero())
+      interval = clock::duration(1);
+
+    return add_timer(clock::now() + interval, interval, std::move(ev),
+                     priority);
+  }
+
+  // false if the delayed event was already queued or cancelled.
+  bool cancel(timer_id id) {
+    std::lock_guard<std::mutex> guard(mtx_);
+    auto it = timer_keys_.find(id);
+    if (it == timer_keys_.end())
+      return false;
+
+    timers_.erase(timer_key(it->second, id));
+    timer_keys_.erase(it);
+    update_next_deadline();
+    return true;
   }
 
+  // delayed events that are not due yet are dropped, outside the locks.
+  // pool mode: wait for the workers, must not be called from a handler.
   void stop() {
-    stop_.store(true);
+    std::map<timer_key, timed_event> dropped;
+    {
+      std::lock_guard<std::mutex> guard(mtx_);
+      stop_.store(true);
+      timers_.swap(dropped);
+      timer_keys_.clear();
+      update_next_deadline();
+    }
     cv_.notify_all();
+    stop_cv_.notify_all();
+    space_cv_.notify_all();
+
+    if (workers_.empty())
+      return;
+
+    for (auto &w : workers_) {
+      if (w->thread.joinable())
+        w->thread.join();
+    }
+
+    for (auto &w : workers_) {
+      std::deque<slot> local;
+      std::lock_guard<std::mutex> guard(w->mtx);
+      w->local.swap(local);
+    }
+    local_pending_.store(0);
+    clear();
   }
 
+  // single consumer: only one thread may call loop().
+  // pool mode: the workers process the events, loop() only blocks the
+  // caller until stop().
   void loop() {
-    while (!stop_.load()) {
-      auto cur_event = dequeue();
-      if (cur_event) {
-        cur_event->process();
+    if (!workers_.empty()) {
+      std::unique_lock<std::mutex> lock(mtx_);
+      stop_cv_.wait(lock, [this]() {
+        return stop_.load();
+      });
+      return;
+    }
+
+    std::deque<slot> batch;
+    handler_cache cache;
+    while (dequeue(batch)) {
+      auto now = now_stamp();
+      while (!batch.empty() && !finished(false)) {
+        auto cur_event = std::move(batch.front());
+        batch.pop_front();
+        dispatch(cur_event, cache, now);
       }
     }
 
-    std::lock_guard<std::mutex> guard(mtx_);
-    queue_.clear();
+    clear();
+  }
+
+  // see event_queue_options::metrics, may be called from any thread.
+  event_queue_stats stats() {
+    event_queue_stats s;
+    if (!opts_.metrics)
+      return s;
+
+    s.depth = size_.load() + local_pending_.load();
+    s.peak_depth = peak_depth_.load();
+    s.wait = wait_.snapshot();
+    s.process = process_.snapshot();
+
+    {
+      std::lock_guard<std::mutex> guard(metrics_mtx_);
+      for (auto &h : handlers_)
+        s.handlers.push_back({h.first.name(), h.second->snapshot()});
+    }
+
+    std::sort(s.handlers.begin(), s.handlers.end(),
+              [](const event_queue_stats::handler_stats &a,
+                 const event_queue_stats::handler_stats &b) {
+                return a.process.sum > b.process.sum;
+              });
+    return s;
   }
 
  private:
-  event_handler::ptr dequeue() {
-    event_handler::ptr cur_event = nullptr;
+  static constexpr int kSpinCount = 64;
+  static constexpr size_t kLaneCount = 3;
+
+  using slot = detail::queued_event<Event>;
+  using lane_type = typename detail::rebind_queue<Queue, slot>::type;
+
+  // a consumer's own view of handlers_, so it only locks metrics_mtx_ the
+  // first time it meets a handler type.
+  using handler_cache =
+      std::unordered_map<const std::type_info *, latency_histogram *>;
+
+  struct worker {
+    std::mutex mtx;
+    std::deque<slot> local;
+    std::thread thread;
+  };
+
+  struct timed_event {
+    clock::duration period;
+    event_priority priority;
+    Event ev;
+  };
+
+  using timer_key = std::pair<clock::time_point, timer_id>;
+  using due_event = std::pair<event_priority, Event>;
+  static constexpr clock::rep kNoDeadline =
+      std::numeric_limits<clock::rep>::max();
+
+  timer_id add_timer(clock::time_point deadline, clock::duration period,
+                     Event ev, event_priority priority) {
+    std::lock_guard<std::mutex> guard(mtx_);
+    auto id = ++last_timer_id_;
+    timers_.emplace(timer_key(deadline, id),
+                    timed_event{period, priority, std::move(ev)});
+    timer_keys_.emplace(id, deadline);
 
+    // a parked consumer has to re-arm its wait for the earlier deadline.
+    if (timers_.begin()->first.second == id) {
+      update_next_deadline();
+      cv_.notify_one();
+    }
+    return id;
+  }
+
+  // mtx_ held.
+  void update_next_deadline() {
+    auto next = timers_.empty()
+                    ? kNoDeadline
+                    : timers_.begin()->first.first.time_since_epoch().count();
+    next_deadline_.store(next);
+  }
+
+  bool timer_due() {
+    auto next = next_deadline_.load();
+    return next != kNoDeadline &&
+           clock::now().time_since_epoch().count() >= next;
+  }
+
+  static Event copy_event(const Event &ev, std::true_type) { return ev; }
+
+  // only periodic events are copied, enqueue_every() rejects those types.
+  static Event copy_event(const Event &, std::false_type) { return Event(); }
+
+  // move the expired delayed events into their lanes, periodic ones are
+  // re-armed at their next period.
+  void fire_timers() {
+    if (!timer_due() && overdue_size_.load() == 0)
+      return;
+
+    std::deque<due_event> due;
     {
-      std::unique_lock<std::mutex> lock(mtx_);
-      cv_.wait(lock, [this]() {
-        return stop_.load() || !queue_.empty();
-      });
+      std::lock_guard<std::mutex> guard(mtx_);
+      due.swap(overdue_);
+      overdue_size_.store(0);
+
+      auto now = clock::now();
+      while (!timers_.empty() && timers_.begin()->first.first <= now) {
+        auto it = timers_.begin();
+        auto key = it->first;
+        auto &timed = it->second;
+
+        if (timed.period == clock::duration::zero()) {
+          due.emplace_back(timed.priority, std::move(timed.ev));
+          timer_keys_.erase(key.second);
+          timers_.erase(it);
+          continue;
+        }
+
+        due.emplace_back(timed.priority,
+                         copy_event(timed.ev,
+                                    std::is_copy_constructible<Event>()));
+
+        auto deadline = key.first + timed.period;
+        if (deadline <= now)
+          deadline = now + timed.period;
+
+        timers_.emplace(timer_key(deadline, key.second), std::move(timed));
+        timer_keys_[key.second] = deadline;
+        timers_.erase(it);
+      }
+      update_next_deadline();
+    }
+
+    // a consumer must not wait for room in its own queue: what does not fit
+    // stays overdue until it has drained some events.
+    while (!due.empty() && push_due(due.front()))
+      due.pop_front();
+
+    if (due.empty())
+      return;
+
+    std::lock_guard<std::mutex> guard(mtx_);
+    while (!due.empty()) {
+      overdue_.emplace_front(std::move(due.back()));
+      due.pop_back();
+    }
+    overdue_size_.store(overdue_.size());
+  }
+
+  // false if the queue is full, ev is left untouched then.
+  bool push_due(due_event &due) {
+    if (counted()) {
+      auto depth = size_.fetch_add(1) + 1;
+      if (full(depth)) {
+        size_.fetch_sub(1);
+        return false;
+      }
+      update_peak_depth(depth);
+      check_high_watermark(depth);
+    }
+
+    auto &lane = *lanes_[static_cast<size_t>(due.first)];
+    slot queued{std::move(due.second), now_stamp()};
+    if (!lane.push(queued)) {
+      due.second = std::move(queued.ev);
+      release(1);
+      return false;
+    }
+
+    wake_one();
+    return true;
+  }
+
+  // stopped and nothing left to process for this consumer.
+  bool finished(bool empty) const {
+    return stop_.load() && (!opts_.drain_on_stop || empty);
+  }
+
+  bool has_work() {
+    for (auto &lane : lanes_) {
+      if (!lane->empty())
+        return true;
+    }
+    return local_pending_.load() > 0 || overdue_size_.load() > 0;
+  }
+
+  void clear() {
+    for (auto &lane : lanes_)
+      lane->clear();
+    size_.store(0);
+
+    std::deque<due_event> overdue;
+    std::lock_guard<std::mutex> guard(mtx_);
+    overdue_.swap(overdue);
+    overdue_size_.store(0);
+  }
+
+  // the depth is only tracked when a capacity, a watermark or the metrics
+  // need it.
+  bool counted() const {
+    return capacity_ || opts_.high_watermark || opts_.metrics;
+  }
+
+  bool full(size_t depth) const { return capacity_ && depth > capacity_; }
+
+  // take a slot for one event, applying the overflow policy when full.
+  bool acquire(bool wait) {
+    if (!counted())
+      return true;
+
+    while (true) {
+      auto depth = size_.fetch_add(1) + 1;
+      if (!full(depth)) {
+        update_peak_depth(depth);
+        check_high_watermark(depth);
+        return true;
+      }
+      size_.fetch_sub(1);
+
+      if (opts_.overflow == overflow_policy::drop_oldest) {
+        if (stop_.load())
+          return false;
+        if (!drop_oldest())
+          std::this_thread::yield();
+        continue;
+      }
+
+      if (!wait || opts_.overflow == overflow_policy::fail)
+        return false;
+
+      if (!wait_for_space())
+        return false;
+    }
+  }
+
+  // take up to count slots without blocking.
+  size_t acquire_bulk(size_t count) {
+    if (!counted())
+      return count;
+
+    auto depth = size_.load();
+    size_t taken = 0;
+    do {
+      taken = count;
+      if (capacity_)
+        taken = depth < capacity_ ? std::min(count, capacity_ - depth) : 0;
+      if (taken == 0)
+        return 0;
+    } while (!size_.compare_exchange_weak(depth, depth + taken));
+
+    update_peak_depth(depth + taken);
+    check_high_watermark(depth + taken);
+    return taken;
+  }
+
+  // give back the slots of events taken out of the lanes.
+  void release(size_t count) {
+    if (!counted() || count == 0)
+      return;
+
+    auto depth = size_.fetch_sub(count) - count;
+    check_low_watermark(depth);
+
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (blocked_.load() == 0)
+      return;
+
+    std::lock_guard<std::mutex> guard(mtx_);
+    space_cv_.notify_all();
+  }
+
+  // false if stopped while waiting.
+  bool wait_for_space() {
+    std::unique_lock<std::mutex> lock(mtx_);
+    blocked_.fetch_add(1);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    space_cv_.wait(lock, [this]() {
+      return stop_.load() || size_.load() < capacity_;
+    });
+    blocked_.fetch_sub(1);
+    return !stop_.load();
+  }
 
+  // pops compete with the consumer, so they are serialized with pop_mtx_.
+  bool drop_oldest() {
+    slot dropped;
+    {
+      std::lock_guard<std::mutex> guard(pop_mtx_);
+      size_t i = kLaneCount;
+      while (i > 0 && !lanes_[i - 1]->pop(dropped))
+        --i;
+
+      if (i == 0)
+        return false;
+    }
+
+    release(1);
+    return true;
+  }
+
+  void update_peak_depth(size_t depth) {
+    if (!opts_.metrics)
+      return;
+
+    auto peak = peak_depth_.load(std::memory_order_relaxed);
+    while (depth > peak && !peak_depth_.compare_exchange_weak(
+                               peak, depth, std::memory_order_relaxed)) {
+    }
+  }
+
+  void check_high_watermark(size_t depth) {
+    if (!opts_.high_watermark || depth < opts_.high_watermark)
+      return;
+
+    if (!above_high_.load() && !above_high_.exchange(true) &&
+        opts_.on_watermark)
+      opts_.on_watermark(depth, true);
+  }
+
+  void check_low_watermark(size_t depth) {
+    if (!opts_.high_watermark || depth > opts_.low_watermark)
+      return;
+
+    if (above_high_.load() && above_high_.exchange(false) &&
+        opts_.on_watermark)
+      opts_.on_watermark(depth, false);
+  }
+
+  // the slot was taken by acquire(), false if stop() came first.
+  bool push(Event &ev, event_priority priority) {
+    auto &lane = *lanes_[static_cast<size_t>(priority)];
+    slot queued{std::move(ev), now_stamp()};
+    while (!lane.push(queued)) {
       if (stop_.load()) {
-        return nullptr;
+        release(1);
+        return false;
       }
+      std::this_thread::yield();
+    }
 
-      cur_event = std::move(queue_.front());
-      queue_.pop_front();
+    wake_one();
+    return true;
+  }
+
+  static uint64_t now_ns() {
+    return static_cast<uint64_t>(
+        std::chrono::duration_cast<std::chrono::nanoseconds>(
+            clock::now().time_since_epoch())
+            .count());
+  }
+
+  // the clock is only read with the metrics on.
+  uint64_t now_stamp() const { return opts_.metrics ? now_ns() : 0; }
+
+  // now: when this event starts, updated to when it finished, so the events
+  // of a batch share their clock reads.
+  void dispatch(slot &cur_event, handler_cache &cache, uint64_t &now) {
+    if (!opts_.metrics) {
+      detail::process_event(cur_event.ev, 0);
+      return;
     }
 
-    return cur_event;
+    auto &handler =
+        handler_histogram(detail::event_type_of(cur_event.ev, 0), cache);
+
+    auto start = now;
+    wait_.record(start > cur_event.enqueued_ns ? start - cur_event.enqueued_ns
+                                               : 0);
+    detail::process_event(cur_event.ev, 0);
+
+    now = now_ns();
+    process_.record(now - start);
+    handler.record(now - start);
+  }
+
+  latency_histogram &handler_histogram(const std::type_info &type,
+                                       handler_cache &cache) {
+    auto it = cache.find(&type);
+    if (it != cache.end())
+      return *it->second;
+
+    std::lock_guard<std::mutex> guard(metrics_mtx_);
+    auto &h = handlers_[std::type_index(type)];
+    if (!h)
+      h.reset(new latency_histogram());
+
+    cache.emplace(&type, h.get());
+    return *h;
+  }
+
+  // consumer only: the highest non-empty lane, unless a lower one has been
+  // passed over starvation_limit times.
+  lane_type *pick_lane() {
+    size_t picked = kLaneCount;
+    for (size_t i = 0; i < kLaneCount; ++i) {
+      if (lanes_[i]->empty()) {
+        skipped_[i] = 0;
+        continue;
+      }
+
+      if (picked == kLaneCount)
+        picked = i;
+      else if (opts_.starvation_limit && skipped_[i] >= opts_.starvation_limit)
+        picked = i;
+      else
+        ++skipped_[i];
+    }
+
+    if (picked == kLaneCount)
+      return nullptr;
+
+    skipped_[picked] = 0;
+    return lanes_[picked].get();
+  }
+
+  // loop() consumer, shares the lanes with dropping producers only under
+  // overflow_policy::drop_oldest.
+  size_t pop_bulk(std::deque<slot> &out, size_t max) {
+    std::unique_lock<std::mutex> lock(pop_mtx_, std::defer_lock);
+    if (opts_.overflow == overflow_policy::drop_oldest)
+      lock.lock();
+
+    auto lane = pick_lane();
+    auto count = lane ? lane->pop_bulk(out, max) : 0;
+    if (lock.owns_lock())
+      lock.unlock();
+
+    release(count);
+    return count;
+  }
+
+  void wake_one() {
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (idle_.load() == 0)
+      return;
+
+    std::lock_guard<std::mutex> guard(mtx_);
+    cv_.notify_one();
+  }
+
+  // spin a little before parking so a busy queue never pays for the futex,
+  // a parked consumer wakes up for the earliest delayed event.
+  void wait_for_work() {
+    for (int i = 0; i < kSpinCount; ++i) {
+      if (stop_.load() || has_work() || timer_due())
+        return;
+
+      std::this_thread::yield();
+    }
+
+    std::unique_lock<std::mutex> lock(mtx_);
+    idle_.fetch_add(1);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    while (!stop_.load() && !has_work()) {
+      if (timers_.empty()) {
+        cv_.wait(lock);
+        continue;
+      }
+
+      auto deadline = timers_.begin()->first.first;
+      if (clock::now() >= deadline)
+        break;
+
+      cv_.wait_until(lock, deadline);
+    }
+    idle_.fetch_sub(1);
+  }
+
+  // false once the consumer is done.
+  bool dequeue(std::deque<slot> &batch) {
+    batch.clear();
+
+    while (true) {
+      if (finished(false))
+        return false;
+
+      fire_timers();
+      if (pop_bulk(batch, max_batch_size()) > 0)
+        return true;
+
+      if (stop_.load())
+        return false;
+
+      wait_for_work();
+    }
+  }
+
+  size_t max_batch_size() const {
+    return opts_.max_batch_size ? opts_.max_batch_size : 1;
+  }
+
+  void worker_loop(size_t index) {
+    slot cur_event{};
+    handler_cache cache;
+    while (true) {
+      fire_timers();
+      if (pop_local(index, cur_event) || pop_shared(index, cur_event) ||
+          steal(index, cur_event)) {
+        if (finished(false))
+          break;
+
+        auto now = now_stamp();
+        dispatch(cur_event, cache, now);
+        cur_event = slot{};
+        continue;
+      }
+
+      if (finished(!has_work()))
+        break;
+
+      wait_for_work();
+    }
+  }
+
+  bool pop_local(size_t index, slot &cur_event) {
+    auto &self = *workers_[index];
+
+    std::lock_guard<std::mutex> guard(self.mtx);
+    if (self.local.empty())
+      return false;
+
+    cur_event = std::move(self.local.front());
+    self.local.pop_front();
+    local_pending_.fetch_sub(1);
+    return true;
+  }
+
+  // take a fair share of the shared queue, keep the rest of the batch local
+  // and wake an idle worker to steal from it. the shared queue only ever
+  // sees one consumer at a time.
+  bool pop_shared(size_t index, slot &cur_event) {
+    auto &self = *workers_[index];
+    size_t kept = 0;
+
+    {
+      std::lock_guard<std::mutex> guard(pop_mtx_);
+      auto lane = pick_lane();
+      if (!lane)
+        return false;
+
+      auto share = lane->size() / workers_.size() + 1;
+      share = std::min(share, max_batch_size());
+
+      std::lock_guard<std::mutex> local_guard(self.mtx);
+      auto count = lane->pop_bulk(self.local, share);
+      if (count == 0)
+        return false;
+
+      cur_event = std::move(self.local.front());
+      self.local.pop_front();
+      kept = count - 1;
+      local_pending_.fetch_add(kept);
+    }
+
+    release(kept + 1);
+
+    if (kept > 0)
+      wake_one();
+
+    return true;
+  }
+
+  // steal the older half of another worker's local deque, in order: both
+  // the owner and the thief start with the oldest events they hold.
+  bool steal(size_t index, slot &cur_event) {
+    if (local_pending_.load() == 0)
+      return false;
+
+    auto &self = *workers_[index];
+    for (size_t i = 1; i < workers_.size(); ++i) {
+      auto &victim = *workers_[(index + i) % workers_.size()];
+
+      std::deque<slot> stolen;
+      {
+        std::lock_guard<std::mutex> guard(victim.mtx);
+        auto count = (victim.local.size() + 1) / 2;
+        for (size_t n = 0; n < count; ++n) {
+          stolen.emplace_back(std::move(victim.local.front()));
+          victim.local.pop_front();
+        }
+      }
+
+      if (stolen.empty())
+        continue;
+
+      cur_event = std::move(stolen.front());
+      stolen.pop_front();
+      local_pending_.fetch_sub(1);
+
+      if (!stolen.empty()) {
+        std::lock_guard<std::mutex> guard(self.mtx);
+        for (auto &ev : stolen)
+          self.local.emplace_back(std::move(ev));
+      }
+
+      return true;
+    }
+
+    return false;
   }
 
  private:
-  std::deque<event_handler::ptr> queue_;
+  event_queue_options opts_;
+
+  std::unique_ptr<lane_type> lanes_[kLaneCount];
+  // opts_.capacity, or the slots of a bounded backend.
+  size_t capacity_{0};
+  size_t skipped_[kLaneCount]{};
   std::atomic_bool stop_{false};
 
   std::mutex mtx_;
   std::condition_variable cv_;
+  std::condition_variable stop_cv_;
+  std::atomic<size_t> idle_{0};
+
+  // capacity and watermarks, see counted().
+  std::condition_variable space_cv_;
+  std::atomic<size_t> size_{0};
+  std::atomic<size_t> blocked_{0};
+  std::atomic_bool above_high_{false};
+
+  // delayed events ordered by deadline, guarded by mtx_.
+  std::map<timer_key, timed_event> timers_;
+  std::unordered_map<timer_id, clock::time_point> timer_keys_;
+  timer_id last_timer_id_{0};
+  std::atomic<clock::rep> next_deadline_{kNoDeadline};
+  // due events that did not fit into their lane yet, guarded by mtx_.
+  std::deque<due_event> overdue_;
+  std::atomic<size_t> overdue_size_{0};
+
+  std::mutex pop_mtx_;
+  std::vector<std::unique_ptr<worker>> workers_;
+  std::atomic<size_t> local_pending_{0};
+
+  // see event_queue_options::metrics.
+  std::atomic<size_t> peak_depth_{0};
+  latency_histogram wait_;
+  latency_histogram process_;
+  std::mutex metrics_mtx_;
+  std::unordered_map<std::type_index, std::unique_ptr<latency_histogram>>
+      handlers_;
 };
 
+using event_queue = basic_event_queue<event_handler::ptr>;
+using mpsc_event_queue =
+    basic_event_queue<event_handler::ptr, mpsc_ring_queue<event_handler::ptr>>;
+
+// callables queued by value, no allocation per event.
+using function_queue = basic_event_queue<inline_event>;
+
 }  // namespace utility
 
 #endif  // __UTILITY_EVENT_QUEUE_HPP__
@@ -25,12 +25,25 @@ THE SOFTWARE.
 #ifndef __UTILITY_FSM_HPP__
 #define __UTILITY_FSM_HPP__
 
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <chrono>
+#include <cstdint>
+#include <fstream>
 #include <functional>
-#include <future>
-#include <iostream>
+#include <limits>
 #include <memory>
 #include <mutex>
+#include <ostream>
+#include <string>
+#include <thread>
+#include <tuple>
+#include <type_traits>
 #include <unordered_map>
+#include <vector>
+
+#include "event_queue.hpp"
 
 namespace utility {
 
@@ -72,6 +85,85 @@ class state_machine {
                                  const std::string &description) = 0;
 };
 
+namespace detail {
+
+// a dense id per event type, indexes the transition tables.
+inline size_t next_event_id() {
+  static std::atomic<size_t> next{0};
+  return next.fetch_add(1);
+}
+
+template <typename Event>
+size_t event_id() {
+  static const size_t id = next_event_id();
+  return id;
+}
+
+template <typename... Ts>
+struct make_void {
+  using type = void;
+};
+
+// FSM_SUBSTATE_TRAITS' parent, void for a top level state.
+template <typename Traits, typename = void>
+struct parent_of {
+  using type = void;
+};
+
+template <typename Traits>
+struct parent_of<Traits, typename make_void<typename Traits::parent>::type> {
+  using type = typename Traits::parent;
+};
+
+inline uint64_t now_ns() {
+  return static_cast<uint64_t>(
+      std::chrono::duration_cast<std::chrono::nanoseconds>(
+          std::chrono::steady_clock::now().time_since_epoch())
+          .count());
+}
+
+// microseconds with the nanoseconds as fraction, what chrome traces use.
+inline void write_us(std::ostream &os, uint64_t ns) {
+  auto frac = std::to_string(ns % 1000);
+  os << ns / 1000 << '.' << std::string(3 - frac.size(), '0') << frac;
+}
+
+inline void write_json_string(std::ostream &os, const std::string &str) {
+  os << '"';
+  for (auto c : str) {
+    if (c == '"' || c == '\\')
+      os << '\\';
+    os << c;
+  }
+  os << '"';
+}
+
+}  // namespace detail
+
+// what a composite state enters when it becomes active again.
+enum class history_type {
+  none,     // its initial state.
+  shallow,  // the direct child that was active when it was left.
+  deep,     // the innermost state that was active when it was left.
+};
+
+// a transition in state_machine_impl::trace(), steady clock nanoseconds.
+struct transition_record {
+  const std::string *from;  // interned state names.
+  const std::string *to;
+  uint64_t exit_ns;     // exit() of from started.
+  uint64_t enter_ns;    // enter() of to started.
+  uint64_t entered_ns;  // enter() of to returned.
+};
+
+// state_machine_impl::state_timings(), nanoseconds.
+struct state_timing_stats {
+  std::string name;
+  latency_histogram::summary dwell;  // from its enter() to its exit().
+  latency_histogram::summary enter;
+  latency_histogram::summary exit;
+};
+
 template <typename FSM, typename StateType = int32_t>
 class state_machine_impl : public state_machine {
  public:
@@ -80,34 +172,33 @@ class state_machine_impl : public state_machine {
 
   ~state_machine_impl() { stop(); }
 
-  state_type cur_state_type() {
-    std::unique_lock<std::mutex> locker(state_mtx_);
-    return cur_state_type_;
-  }
+  // readers never lock: the current state is published as one pointer.
+  state_type cur_state_type() const { return cur_entry().type; }
 
-  std::string cur_state_name() {
-    std::unique_lock<std::mutex> locker(state_mtx_);
-    return cur_state_name_;
-  }
+  // interned, valid as long as the program runs.
+  const std::string &cur_state_name() const { return *cur_entry().name; }
 
-  std::shared_ptr<fsm_state> cur_state() {
-    std::unique_lock<std::mutex> locker(state_mtx_);
-    return cur_state_;
-  }
+  std::shared_ptr<fsm_state> cur_state() const { return cur_entry().state; }
 
+  // waits for the posted events, must not be called from one of them.
   virtual void stop() override {
-    if (trans_fut_.valid()) {
-      std::cout << "wait trigger_state_transfer..." << std::endl;
-      trans_fut_.wait();
+    wait_posted();
+    std::unique_ptr<function_queue> own_queue;
+    {
+      std::unique_lock<std::mutex> locker(state_mtx_);
+      own_queue = std::move(own_queue_);
+      if (own_queue)
+        queue_.store(nullptr);
     }
+    if (own_queue)
+      own_queue->stop();
 
     std::unique_lock<std::mutex> locker(state_mtx_);
-    if (cur_state_) {
-      cur_state_->exit();
-      cur_state_ = nullptr;
-    }
-    cur_state_name_ = "";
-    cur_state_type_ = {};
+    auto &path = cur_entry().path;
+    for (auto i = path.size(); i > 0; --i)
+      path[i - 1]->state->exit();
+
+    cur_.store(&no_state(true), std::memory_order_release);
   }
 
   virtual void set_state_changed_notifier(
@@ -121,17 +212,126 @@ class state_machine_impl : public state_machine {
     return state && state->transfer();
   }
 
+  // queued behind the posted events.
   virtual void async_trigger_state_transfer() override {
-    trans_fut_ = std::async([this]() {
+    post([this]() {
       trigger_state_transfer();
     });
   }
 
+  // posted events run on this queue instead of one the machine starts on
+  // demand (a single worker thread). set it before the first post.
+  void set_event_queue(function_queue &queue) { queue_.store(&queue); }
+
+  // transition table, built before events flow (e.g. in init()): Event in
+  // state From moves to To when guard passes, action runs between the exit
+  // of From and the enter of To. rows of an event are tried in the order
+  // they were added.
+  template <typename From, typename Event, typename To>
+  void add_transition(
+      std::function<bool(FSM &, const Event &)> guard = nullptr,
+      std::function<void(FSM &, const Event &)> action = nullptr,
+      const std::string &description = "") {
+    transition t;
+    t.from = From::traits::type();
+    {
+      std::unique_lock<std::mutex> locker(state_mtx_);
+      auto &from = get_state<From>();
+      t.to = &get_state<To>();
+      t.common = common_depth(from.path, t.to->path, t.to->path.size() - 1);
+    }
+    if (guard)
+      t.guard = [guard](FSM &fsm, const void *ev) {
+        return guard(fsm, *static_cast<const Event *>(ev));
+      };
+    if (action)
+      t.action = [action](FSM &fsm, const void *ev) {
+        action(fsm, *static_cast<const Event *>(ev));
+      };
+    t.description = description;
+
+    auto id = detail::event_id<Event>();
+    if (id >= transitions_.size())
+      transitions_.resize(id + 1);
+    transitions_[id].push_back(std::move(t));
+  }
+
+  // run the event on the calling thread, false if no row matched.
+  template <typename Event>
+  bool process_event(const Event &ev) {
+    auto id = detail::event_id<Event>();
+    if (id >= transitions_.size())
+      return false;
+
+    // the innermost active state with a matching row handles the event.
+    auto &path = cur_entry().path;
+    for (auto i = path.size(); i > 0; --i) {
+      for (auto &t : transitions_[id]) {
+        if (t.from != path[i - 1]->type ||
+            (t.guard && !t.guard(*get(), &ev)))
+          continue;
+
+        transit(*t.to, t.description, &t, &ev);
+        return true;
+      }
+    }
+    return false;
+  }
+
+  // process_event() on the event queue, events run in the order posted.
+  template <typename Event>
+  void post_event(Event ev) {
+    post([this, ev]() {
+      process_event(ev);
+    });
+  }
+
+  // the innermost active state is FsmState.
   template <typename FsmState>
-  bool is_state() {
+  bool is_state() const {
     return cur_state_type() == FsmState::traits::type();
   }
 
+  // FsmState is active: the innermost state or one of its ancestors.
+  template <typename FsmState>
+  bool is_in() const {
+    for (auto entry : cur_entry().path) {
+      if (entry->type == FsmState::traits::type())
+        return true;
+    }
+    return false;
+  }
+
+  // entering the composite Parent goes on to Child (FSM_SUBSTATE_TRAITS)
+  // unless its history remembers another one. set up before the first
+  // transition, like the transition table.
+  template <typename Parent, typename Child>
+  void set_initial_state() {
+    static_assert(
+        std::is_same<typename detail::parent_of<typename Child::traits>::type,
+                     Parent>::value,
+        "Child must be a substate of Parent");
+
+    std::unique_lock<std::mutex> locker(state_mtx_);
+    auto &child = get_state<Child>();
+    get_state<Parent>().initial = &child;
+  }
+
+  template <typename Parent>
+  void set_history(history_type history) {
+    std::unique_lock<std::mutex> locker(state_mtx_);
+    get_state<Parent>().history = history;
+  }
+
+  // create the states up front, normally from init(), so that no
+  // transition allocates or pays for a first-time creation.
+  template <typename... FsmStates>
+  void register_states() {
+    std::unique_lock<std::mutex> locker(state_mtx_);
+    int dummy[] = {(get_state<FsmStates>(), 0)...};
+    (void)dummy;
+  }
+
   template <typename FsmState>
   void init_state() {
     change_state<FsmState>("init");
@@ -143,43 +343,410 @@ class state_machine_impl : public state_machine {
       change_state<FsmState>(description);
   }
 
+  // keep the last capacity transitions and time every state, call it before
+  // the first transition (e.g. in init()). nothing is allocated afterwards.
+  void enable_trace(size_t capacity = 1024) {
+    std::unique_lock<std::mutex> locker(state_mtx_);
+    std::lock_guard<std::mutex> guard(trace_mtx_);
+    trace_.assign(capacity ? capacity : 1, transition_record());
+    trace_next_ = 0;
+    entered_ns_ = 0;
+    tracing_.store(true);
+
+    for (auto &entry : state_table_) {
+      if (entry && !entry->timing)
+        entry->timing.reset(new state_timing());
+    }
+    for (auto &entry : state_mgr_) {
+      if (!entry.second->timing)
+        entry.second->timing.reset(new state_timing());
+    }
+  }
+
+  // oldest first.
+  std::vector<transition_record> trace() {
+    std::lock_guard<std::mutex> guard(trace_mtx_);
+    std::vector<transition_record> records;
+    auto size = std::min(trace_next_, trace_.size());
+    for (auto i = trace_next_ - size; i < trace_next_; ++i)
+      records.push_back(trace_[i % trace_.size()]);
+    return records;
+  }
+
+  std::vector<state_timing_stats> state_timings() {
+    std::vector<state_timing_stats> timings;
+    std::unique_lock<std::mutex> locker(state_mtx_);
+    auto add = [&timings](const state_entry &entry) {
+      if (entry.timing)
+        timings.push_back({*entry.name, entry.timing->dwell.snapshot(),
+                           entry.timing->enter.snapshot(),
+                           entry.timing->exit.snapshot()});
+    };
+
+    for (auto &entry : state_table_) {
+      if (entry)
+        add(*entry);
+    }
+    for (auto &entry : state_mgr_)
+      add(*entry.second);
+    return timings;
+  }
+
+  // the trace as chrome://tracing / perfetto json: a span per state visit
+  // with its exit() and enter() nested.
+  void write_chrome_trace(std::ostream &os) {
+    auto records = trace();
+    auto now = detail::now_ns();
+
+    os << "{\"traceEvents\":[";
+    auto first = true;
+    auto span = [&os, &first](const std::string &name, uint64_t begin,
+                              uint64_t end) {
+      os << (first ? "\n" : ",\n") << "{\"name\":";
+      detail::write_json_string(os, name);
+      os << ",\"ph\":\"X\",\"pid\":1,\"tid\":1,\"ts\":";
+      detail::write_us(os, begin);
+      os << ",\"dur\":";
+      detail::write_us(os, end > begin ? end - begin : 0);
+      os << "}";
+      first = false;
+    };
+
+    for (size_t i = 0; i < records.size(); ++i) {
+      auto &r = records[i];
+      auto left = i + 1 < records.size() ? records[i + 1].exit_ns : now;
+      span(*r.to, r.enter_ns, left);
+      span("enter " + *r.to, r.enter_ns, r.entered_ns);
+      if (i + 1 < records.size())
+        span("exit " + *r.to, left, records[i + 1].enter_ns);
+    }
+    os << "\n]}\n";
+  }
+
+  bool export_chrome_trace(const std::string &path) {
+    std::ofstream os(path);
+    if (!os)
+      return false;
+
+    write_chrome_trace(os);
+    return static_cast<bool>(os);
+  }
+
   template <typename FsmState>
   void change_state(const std::string &description = "") {
-    auto new_state_enum = FsmState::traits::type();
-    auto new_state_name = FsmState::traits::name();
+    state_entry *next = nullptr;
+    {
+      std::unique_lock<std::mutex> locker(state_mtx_);
+      next = &get_state<FsmState>();
+    }
+    transit(*next, description, nullptr, nullptr);
+  }
+
+ private:
+  struct state_timing {
+    latency_histogram dwell;
+    latency_histogram enter;
+    latency_histogram exit;
+  };
+
+  // what readers see of the current state. entries live as long as the
+  // machine, readers only use the members set before it is published.
+  struct state_entry {
+    state_entry(state_type type, const std::string *name,
+                std::shared_ptr<fsm_state> state)
+        : type(type), name(name), state(std::move(state)) {}
+
+    state_type type;
+    const std::string *name;
+    std::shared_ptr<fsm_state> state;
+    // the ancestors and the state itself, outermost first.
+    std::vector<state_entry *> path;
+
+    // composite states, written by the transitions.
+    state_entry *initial{nullptr};
+    history_type history{history_type::none};
+    state_entry *last_child{nullptr};
+    state_entry *last_leaf{nullptr};
+
+    // see enable_trace().
+    std::unique_ptr<state_timing> timing;
+  };
+
+  // a row of the transition table, the event is type-erased.
+  struct transition {
+    state_type from;
+    state_entry *to;
+    // the depth of the least common ancestor of from and to, see transit().
+    size_t common;
+    std::function<bool(FSM &, const void *)> guard;
+    std::function<void(FSM &, const void *)> action;
+    std::string description;
+  };
+
+  // the innermost state target enters: its history or initial state, down
+  // to a leaf.
+  static state_entry &resolve(state_entry &target) {
+    auto entry = &target;
+    while (true) {
+      if (entry->history == history_type::deep && entry->last_leaf)
+        return *entry->last_leaf;
+
+      auto child = entry->history == history_type::shallow && entry->last_child
+                       ? entry->last_child
+                       : entry->initial;
+      if (!child)
+        return *entry;
+      entry = child;
+    }
+  }
+
+  // how many outer states the two paths share, at most limit.
+  static size_t common_depth(const std::vector<state_entry *> &from,
+                             const std::vector<state_entry *> &to,
+                             size_t limit) {
+    size_t common = 0;
+    while (common < limit && common < from.size() && common < to.size() &&
+           from[common] == to[common])
+      ++common;
+    return common;
+  }
+
+  // states below the least common ancestor are left innermost first, then
+  // entered outermost first down to the resolved leaf. the target itself is
+  // always left and entered again. a table row knows its ancestor (that of
+  // its from and to states) up front, change_state() looks at the current
+  // state; only the history below target is resolved per transition.
+  void transit(state_entry &target, const std::string &description,
+               const transition *t, const void *ev) {
+    auto tracing = tracing_.load(std::memory_order_relaxed);
+    transition_record record{};
+    record.exit_ns = tracing ? detail::now_ns() : 0;
+
+    auto &old_entry = cur_entry();
+    auto &next = resolve(target);
+    auto &from = old_entry.path;
+    auto &to = next.path;
 
-    auto old_state = cur_state();
-    if (old_state)
-      old_state->exit();
+    auto common = t ? t->common
+                    : common_depth(from, to, target.path.size() - 1);
 
-    log_state_changed(cur_state_name(), new_state_name, description);
+    for (auto i = from.size(); i > common; --i) {
+      auto leaving = from[i - 1];
+      if (leaving->state)
+        leaving->state->exit();
+
+      auto parent = i > 1 ? from[i - 2] : nullptr;
+      if (parent) {
+        parent->last_child = leaving;
+        parent->last_leaf = from.back();
+      }
+    }
+
+    auto exited = tracing ? detail::now_ns() : 0;
+
+    log_state_changed(*old_entry.name, *next.name, description);
+
+    if (t && t->action)
+      t->action(*get(), ev);
 
     {
       // set new state
       std::unique_lock<std::mutex> locker(state_mtx_);
-      cur_state_ = get_state<FsmState>();
-      cur_state_name_ = new_state_name;
-      cur_state_type_ = new_state_enum;
-      cur_state_->set_fsm(get());
+      cur_.store(&next, std::memory_order_release);
     }
 
     notify_state_changed();
 
-    auto new_state = cur_state();
-    new_state->enter();
+    record.enter_ns = tracing ? detail::now_ns() : 0;
+    for (auto i = common; i < to.size(); ++i)
+      to[i]->state->enter();
+
+    if (tracing) {
+      record.from = old_entry.name;
+      record.to = next.name;
+      record.entered_ns = detail::now_ns();
+      add_trace(old_entry, next, record, exited);
+    }
+  }
+
+  void add_trace(const state_entry &old_entry, const state_entry &next,
+                 const transition_record &record, uint64_t exited) {
+    std::lock_guard<std::mutex> guard(trace_mtx_);
+    if (old_entry.timing) {
+      if (entered_ns_)
+        old_entry.timing->dwell.record(record.exit_ns - entered_ns_);
+      old_entry.timing->exit.record(exited - record.exit_ns);
+    }
+    if (next.timing)
+      next.timing->enter.record(record.entered_ns - record.enter_ns);
+
+    entered_ns_ = record.enter_ns;
+    trace_[trace_next_++ % trace_.size()] = record;
+  }
+
+  function_queue &events() {
+    auto queue = queue_.load();
+    if (queue)
+      return *queue;
+
+    std::unique_lock<std::mutex> locker(state_mtx_);
+    if (!queue_.load()) {
+      event_queue_options opts;
+      opts.thread_count = 1;
+      opts.drain_on_stop = true;
+      own_queue_.reset(new function_queue(opts));
+      queue_.store(own_queue_.get());
+    }
+    return *queue_.load();
+  }
+
+  // holds one posted count, released once the event ran or was destroyed
+  // unrun: rejected, or dropped by the queue's stop() or clear().
+  template <typename F>
+  class posted_event {
+   public:
+    posted_event(state_machine_impl *fsm, F f)
+        : fsm_(fsm), f_(std::move(f)) {}
+
+    posted_event(posted_event &&other) noexcept(
+        std::is_nothrow_move_constructible<F>::value)
+        : fsm_(other.fsm_), f_(std::move(other.f_)) {
+      other.fsm_ = nullptr;
+    }
+
+    posted_event(const posted_event &) = delete;
+    posted_event &operator=(const posted_event &) = delete;
+
+    ~posted_event() { release(); }
+
+    void operator()() {
+      f_();
+      release();
+    }
+
+   private:
+    void release() {
+      if (fsm_)
+        fsm_->finish_posted();
+      fsm_ = nullptr;
+    }
+
+    state_machine_impl *fsm_;
+    F f_;
+  };
+
+  template <typename F>
+  void post(F f) {
+    posted_.fetch_add(1);
+    events().enqueue(posted_event<F>(this, std::move(f)));
+  }
+
+  void finish_posted() {
+    if (posted_.fetch_sub(1) != 1)
+      return;
+
+    std::lock_guard<std::mutex> guard(posted_mtx_);
+    posted_cv_.notify_all();
+  }
+
+  void wait_posted() {
+    std::unique_lock<std::mutex> lock(posted_mtx_);
+    posted_cv_.wait(lock, [this]() {
+      return posted_.load() == 0;
+    });
   }
 
- private:
   FSM *get() { return static_cast<FSM *>(this); }
 
-  // flyweight: if not exist, create it and return.
+  const state_entry &cur_entry() const {
+    return *cur_.load(std::memory_order_acquire);
+  }
+
   template <typename FsmState>
-  std::shared_ptr<fsm_state> get_state() {
+  static const std::string &interned_name() {
+    static const std::string name = FsmState::traits::name();
+    return name;
+  }
+
+  // before the first and after stop().
+  static const state_entry &no_state(bool stopped) {
+    static const std::string null_name{"null"};
+    static const std::string stopped_name;
+    static const state_entry null_entry{state_type{}, &null_name, nullptr};
+    static const state_entry stopped_entry{state_type{}, &stopped_name,
+                                           nullptr};
+    return stopped ? stopped_entry : null_entry;
+  }
+
+  // integral and enum state types below this are indexed directly.
+  static constexpr size_t kFlatStateLimit = 256;
+
+  using flat_state_type =
+      std::integral_constant<bool, std::is_integral<state_type>::value ||
+                                       std::is_enum<state_type>::value>;
+
+  // flyweight: if not exist, create it (and its ancestors) and return.
+  // state_mtx_ held.
+  template <typename FsmState>
+  state_entry &get_state() {
     auto type = FsmState::traits::type();
-    if (state_mgr_.count(type) == 0)
-      state_mgr_[type] = FsmState::traits::creator();
+    auto entry = find_entry(type);
+    if (entry)
+      return *entry;
+
+    using parent = typename detail::parent_of<typename FsmState::traits>::type;
+    auto parent_entry = get_parent<parent>(std::is_void<parent>());
+
+    std::unique_ptr<state_entry> created(new state_entry(
+        type, &interned_name<FsmState>(), FsmState::traits::creator()));
+    created->state->set_fsm(get());
+    if (tracing_)
+      created->timing.reset(new state_timing());
+    if (parent_entry)
+      created->path = parent_entry->path;
+    created->path.push_back(created.get());
+
+    auto flat = flat_index(type, flat_state_type());
+    if (flat < kFlatStateLimit) {
+      if (flat >= state_table_.size())
+        state_table_.resize(flat + 1);
+      state_table_[flat] = std::move(created);
+      return *state_table_[flat];
+    }
+
+    auto &slot = state_mgr_[type];
+    slot = std::move(created);
+    return *slot;
+  }
+
+  template <typename Parent>
+  state_entry *get_parent(std::false_type) {
+    return &get_state<Parent>();
+  }
+
+  template <typename Parent>
+  state_entry *get_parent(std::true_type) {
+    return nullptr;
+  }
+
+  state_entry *find_entry(const state_type &type) {
+    auto flat = flat_index(type, flat_state_type());
+    if (flat < kFlatStateLimit)
+      return flat < state_table_.size() ? state_table_[flat].get() : nullptr;
+
+    auto it = state_mgr_.find(type);
+    return it == state_mgr_.end() ? nullptr : it->second.get();
+  }
+
+  // kFlatStateLimit for sparse or non-integral types, they live in
+  // state_mgr_.
+  static size_t flat_index(state_type type, std::true_type) {
+    auto index = static_cast<size_t>(type);
+    return index < kFlatStateLimit ? index : kFlatStateLimit;
+  }
 
-    return state_mgr_[type];
+  static size_t flat_index(const state_type &, std::false_type) {
+    return kFlatStateLimit;
   }
 
   void notify_state_changed() {
@@ -194,25 +761,490 @@ class state_machine_impl : public state_machine {
   }
 
  private:
-  std::future<void> trans_fut_;
+  // posted events, in flight on queue_.
+  std::atomic<function_queue *> queue_{nullptr};
+  std::unique_ptr<function_queue> own_queue_;
+  std::atomic<size_t> posted_{0};
+  std::mutex posted_mtx_;
+  std::condition_variable posted_cv_;
 
+  // indexed by detail::event_id<Event>().
+  std::vector<std::vector<transition>> transitions_;
+
+  // see enable_trace(), trace_mtx_ guards the ring and entered_ns_.
+  std::atomic_bool tracing_{false};
+  std::mutex trace_mtx_;
+  std::vector<transition_record> trace_;
+  size_t trace_next_{0};
+  uint64_t entered_ns_{0};
+
+  // serializes the writers, readers only load cur_.
   std::mutex state_mtx_;
-  state_type cur_state_type_{};
-  std::string cur_state_name_{"null"};
-  std::shared_ptr<fsm_state> cur_state_{nullptr};
+  std::atomic<const state_entry *> cur_{&no_state(false)};
   state_changed_notifier state_changed_notifier_{nullptr};
-  std::unordered_map<state_type, std::shared_ptr<fsm_state>> state_mgr_;
+  // entries keep their address, cur_ points into them.
+  std::vector<std::unique_ptr<state_entry>> state_table_;
+  std::unordered_map<state_type, std::unique_ptr<state_entry>> state_mgr_;
+};
+
+namespace detail {
+
+template <typename T, typename... Ts>
+struct index_of;
+
+template <typename T, typename... Ts>
+struct index_of<T, T, Ts...> : std::integral_constant<size_t, 0> {};
+
+template <typename T, typename U, typename... Ts>
+struct index_of<T, U, Ts...>
+    : std::integral_constant<size_t, 1 + index_of<T, Ts...>::value> {};
+
+template <typename T, typename... Ts>
+struct first_of {
+  using type = T;
+};
+
+}  // namespace detail
+
+// state of a static_state_machine: plain members, no virtual calls.
+template <typename FSM>
+class static_state {
+ public:
+  using state_machine = FSM;
+
+  void enter() {}
+  void exit() {}
+  bool transfer() { return false; }
+
+  void set_fsm(state_machine *fsm) { fsm_ = fsm; }
+
+ protected:
+  state_machine *fsm_{nullptr};
+};
+
+// the state set is fixed at compile time: States (with FSM_STATE_TRAITS)
+// live by value inside the machine, change_state<T>() calls T::enter()
+// directly and leaves the current state through a table indexed by its
+// position. no heap, no hashing, not thread-safe.
+//   class light : public fsm::static_state_machine<light, red, green> {};
+template <typename FSM, typename... States>
+class static_state_machine {
+ public:
+  using state_type = typename std::decay<decltype(
+      detail::first_of<States...>::type::traits::type())>::type;
+
+  static constexpr size_t kStateCount = sizeof...(States);
+
+  static_state_machine() {
+    int dummy[] = {(get_state<States>().set_fsm(get()), 0)...};
+    (void)dummy;
+  }
+
+  ~static_state_machine() { stop(); }
+
+  state_type cur_state_type() const {
+    static const state_type types[] = {States::traits::type()...};
+    return cur_ == kNoState ? state_type{} : types[cur_];
+  }
+
+  const std::string &cur_state_name() const {
+    static const std::string null_name{"null"};
+    static const std::string names[] = {States::traits::name()...};
+    return cur_ == kNoState ? null_name : names[cur_];
+  }
+
+  template <typename FsmState>
+  bool is_state() const {
+    return cur_ == index<FsmState>();
+  }
+
+  template <typename FsmState>
+  FsmState &get_state() {
+    return std::get<index<FsmState>()>(states_);
+  }
+
+  template <typename FsmState>
+  void init_state() {
+    change_state<FsmState>();
+  }
+
+  template <typename FsmState>
+  void try_change_state() {
+    if (!is_state<FsmState>())
+      change_state<FsmState>();
+  }
+
+  template <typename FsmState>
+  void change_state() {
+    exit_cur();
+    cur_ = index<FsmState>();
+    get_state<FsmState>().enter();
+  }
+
+  bool trigger_state_transfer() {
+    using transfer_fn = bool (*)(static_state_machine &);
+    static const transfer_fn table[] = {&transfer_state<States>...};
+    return cur_ != kNoState && table[cur_](*this);
+  }
+
+  void stop() {
+    exit_cur();
+    cur_ = kNoState;
+  }
+
+ private:
+  static constexpr size_t kNoState = static_cast<size_t>(-1);
+
+  template <typename FsmState>
+  static constexpr size_t index() {
+    return detail::index_of<FsmState, States...>::value;
+  }
+
+  template <typename FsmState>
+  static void exit_state(static_state_machine &fsm) {
+    fsm.get_state<FsmState>().exit();
+  }
+
+  template <typename FsmState>
+  static bool transfer_state(static_state_machine &fsm) {
+    return fsm.get_state<FsmState>().transfer();
+  }
+
+  void exit_cur() {
+    using exit_fn = void (*)(static_state_machine &);
+    static const exit_fn table[] = {&exit_state<States>...};
+    if (cur_ != kNoState)
+      table[cur_](*this);
+  }
+
+  FSM *get() { return static_cast<FSM *>(this); }
+
+ private:
+  std::tuple<States...> states_;
+  size_t cur_{kNoState};
+};
+
+using instance_id = uint32_t;
+
+// state of a state_machine_pool: one object serves every instance, the
+// per-instance data lives in arrays the FSM indexes by id.
+template <typename FSM>
+class shared_state {
+ public:
+  virtual ~shared_state() = default;
+
+  virtual void enter(FSM & /*fsm*/, instance_id /*id*/) {}
+  virtual void exit(FSM & /*fsm*/, instance_id /*id*/) {}
+};
+
+// many small machines sharing one transition table: an instance is only
+// its current state, sizeof(StateType) bytes in chunked arrays. events are
+// routed to shard id % shard_count, every shard runs its events in order
+// on a worker thread of its own, so an instance never needs a lock.
+// the state types (FSM_STATE_TRAITS) are small integers that index the
+// state table, the largest StateType value means "no instance".
+//   class sessions : public fsm::state_machine_pool<sessions> {};
+template <typename FSM, typename StateType = uint8_t>
+class state_machine_pool {
+ public:
+  using state_type = StateType;
+  using fsm_state = shared_state<FSM>;
+
+  static constexpr state_type kNoState =
+      std::numeric_limits<state_type>::max();
+
+  explicit state_machine_pool(size_t shard_count = 0) {
+    if (shard_count == 0)
+      shard_count = std::max(1u, std::thread::hardware_concurrency());
+
+    event_queue_options opts;
+    opts.thread_count = 1;
+    opts.drain_on_stop = true;
+    for (size_t i = 0; i < shard_count; ++i)
+      shards_.emplace_back(new function_queue(opts));
+
+    for (auto &dir : dirs_)
+      dir.store(nullptr, std::memory_order_relaxed);
+  }
+
+  ~state_machine_pool() {
+    stop();
+    for (auto &dir : dirs_) {
+      auto chunks = dir.load();
+      if (!chunks)
+        continue;
+
+      for (size_t i = 0; i < kDirSize; ++i)
+        delete[] chunks[i].load();
+      delete[] chunks;
+    }
+  }
+
+  state_machine_pool(const state_machine_pool &) = delete;
+  state_machine_pool &operator=(const state_machine_pool &) = delete;
+
+  // the states and the table are set up before any instance is created.
+  template <typename... FsmStates>
+  void register_states() {
+    int dummy[] = {(add_state<FsmStates>(), 0)...};
+    (void)dummy;
+  }
+
+  // Event in state From moves to To when guard passes, action runs between
+  // the exit of From and the enter of To.
+  template <typename From, typename Event, typename To>
+  void add_transition(
+      std::function<bool(FSM &, instance_id, const Event &)> guard = nullptr,
+      std::function<void(FSM &, instance_id, const Event &)> action =
+          nullptr) {
+    transition t;
+    t.from = type_of<From>();
+    t.to = type_of<To>();
+    if (guard)
+      t.guard = [guard](FSM &fsm, instance_id id, const void *ev) {
+        return guard(fsm, id, *static_cast<const Event *>(ev));
+      };
+    if (action)
+      t.action = [action](FSM &fsm, instance_id id, const void *ev) {
+        action(fsm, id, *static_cast<const Event *>(ev));
+      };
+
+    auto id = detail::event_id<Event>();
+    if (id >= transitions_.size())
+      transitions_.resize(id + 1);
+    transitions_[id].push_back(std::move(t));
+  }
+
+  // a new instance in FsmState, its enter() runs on the shard.
+  template <typename FsmState>
+  instance_id create() {
+    auto id = allocate();
+    cell(id).store(type_of<FsmState>(), std::memory_order_release);
+    size_.fetch_add(1);
+
+    shard(id).enqueue([this, id]() {
+      auto cur = cell(id).load(std::memory_order_acquire);
+      if (cur != kNoState)
+        states_[cur]->enter(*get(), id);
+    });
+    return id;
+  }
+
+  // exit() runs on the shard, the id is reused afterwards. unknown ids are
+  // ignored.
+  void destroy(instance_id id) {
+    shard(id).enqueue([this, id]() {
+      auto chunk = find_chunk(id);
+      if (!chunk)
+        return;
+
+      auto &c = chunk[id & kChunkMask];
+      auto cur = c.load(std::memory_order_acquire);
+      if (cur == kNoState)
+        return;
+
+      states_[cur]->exit(*get(), id);
+      c.store(kNoState, std::memory_order_release);
+      size_.fetch_sub(1);
+
+      std::lock_guard<std::mutex> guard(alloc_mtx_);
+      free_ids_.push_back(id);
+    });
+  }
+
+  // live instances.
+  size_t size() const { return size_.load(); }
+
+  size_t shard_count() const { return shards_.size(); }
+
+  // lock-free, kNoState for unknown or destroyed ids.
+  state_type state_of(instance_id id) const {
+    auto chunk = find_chunk(id);
+    if (!chunk)
+      return kNoState;
+
+    return chunk[id & kChunkMask].load(std::memory_order_acquire);
+  }
+
+  template <typename FsmState>
+  bool is_state(instance_id id) const {
+    return state_of(id) == type_of<FsmState>();
+  }
+
+  // on the thread of the id's shard only (e.g. from an action), false if no
+  // row matched or the id is unknown.
+  template <typename Event>
+  bool process_event(instance_id id, const Event &ev) {
+    auto event = detail::event_id<Event>();
+    if (event >= transitions_.size())
+      return false;
+
+    auto chunk = find_chunk(id);
+    if (!chunk)
+      return false;
+
+    auto &c = chunk[id & kChunkMask];
+    auto from = c.load(std::memory_order_relaxed);
+    if (from == kNoState)
+      return false;
+
+    for (auto &t : transitions_[event]) {
+      if (t.from != from || (t.guard && !t.guard(*get(), id, &ev)))
+        continue;
+
+      states_[from]->exit(*get(), id);
+      if (t.action)
+        t.action(*get(), id, &ev);
+      c.store(t.to, std::memory_order_release);
+      states_[t.to]->enter(*get(), id);
+      return true;
+    }
+    return false;
+  }
+
+  // process_event() on the id's shard, in the order posted.
+  template <typename Event>
+  bool post_event(instance_id id, Event ev) {
+    return shard(id).enqueue([this, id, ev]() {
+      process_event(id, ev);
+    });
+  }
+
+  // process the posted events and join the shards, nothing is processed
+  // afterwards.
+  void stop() {
+    for (auto &s : shards_)
+      s->stop();
+  }
+
+ private:
+  struct transition {
+    state_type from;
+    state_type to;
+    std::function<bool(FSM &, instance_id, const void *)> guard;
+    std::function<void(FSM &, instance_id, const void *)> action;
+  };
+
+  // 2^8 directories of 2^12 chunks of 2^12 instances cover every
+  // instance_id. a directory or chunk is allocated with its first id.
+  static constexpr size_t kChunkBits = 12;
+  static constexpr size_t kChunkSize = size_t(1) << kChunkBits;
+  static constexpr size_t kChunkMask = kChunkSize - 1;
+  static constexpr size_t kDirBits = 12;
+  static constexpr size_t kDirSize = size_t(1) << kDirBits;
+  static constexpr size_t kDirMask = kDirSize - 1;
+  static constexpr size_t kDirCount = size_t(1) << (32 - kDirBits - kChunkBits);
+
+  using chunk_ptr = std::atomic<std::atomic<state_type> *>;
+
+  FSM *get() { return static_cast<FSM *>(this); }
+
+  template <typename FsmState>
+  static state_type type_of() {
+    return static_cast<state_type>(FsmState::traits::type());
+  }
+
+  template <typename FsmState>
+  void add_state() {
+    static_assert(static_cast<state_type>(FsmState::traits::type()) !=
+                      std::numeric_limits<state_type>::max(),
+                  "the largest StateType value is kNoState");
+
+    auto type = type_of<FsmState>();
+    if (type >= states_.size())
+      states_.resize(type + 1);
+    states_[type] = FsmState::traits::creator();
+  }
+
+  function_queue &shard(instance_id id) {
+    return *shards_[id % shards_.size()];
+  }
+
+  // nullptr until an id of the chunk was handed out.
+  std::atomic<state_type> *find_chunk(instance_id id) const {
+    auto dir = static_cast<size_t>(id) >> (kDirBits + kChunkBits);
+    if (dir >= kDirCount)
+      return nullptr;
+
+    auto chunks = dirs_[dir].load(std::memory_order_acquire);
+    if (!chunks)
+      return nullptr;
+
+    return chunks[(id >> kChunkBits) & kDirMask].load(
+        std::memory_order_acquire);
+  }
+
+  // ids handed out by allocate() only.
+  std::atomic<state_type> &cell(instance_id id) {
+    return find_chunk(id)[id & kChunkMask];
+  }
+
+  instance_id allocate() {
+    std::lock_guard<std::mutex> guard(alloc_mtx_);
+    if (!free_ids_.empty()) {
+      auto id = free_ids_.back();
+      free_ids_.pop_back();
+      return id;
+    }
+
+    auto id = next_id_++;
+    auto &dir = dirs_[id >> (kDirBits + kChunkBits)];
+    if (!dir.load(std::memory_order_relaxed)) {
+      auto chunks = new chunk_ptr[kDirSize];
+      for (size_t i = 0; i < kDirSize; ++i)
+        chunks[i].store(nullptr, std::memory_order_relaxed);
+      dir.store(chunks, std::memory_order_release);
+    }
+
+    auto &chunk =
+        dir.load(std::memory_order_relaxed)[(id >> kChunkBits) & kDirMask];
+    if (!chunk.load(std::memory_order_relaxed)) {
+      auto cells = new std::atomic<state_type>[kChunkSize];
+      for (size_t i = 0; i < kChunkSize; ++i)
+        cells[i].store(kNoState, std::memory_order_relaxed);
+      chunk.store(cells, std::memory_order_release);
+    }
+    return id;
+  }
+
+ private:
+  std::vector<std::unique_ptr<function_queue>> shards_;
+
+  // indexed by the state type and by detail::event_id<Event>().
+  std::vector<std::shared_ptr<fsm_state>> states_;
+  std::vector<std::vector<transition>> transitions_;
+
+  std::atomic<chunk_ptr *> dirs_[kDirCount];
+  std::atomic<size_t> size_{0};
+
+  std::mutex alloc_mtx_;
+  instance_id next_id_{0};
+  std::vector<instance_id> free_ids_;
 };
 
 }  // namespace fsm
 
-#define FSM_STATE_TRAITS(ClassName, StateType)                        \
-  struct traits {                                                     \
-    static constexpr decltype(StateType) type() { return StateType; } \
-    static std::string name() { return #ClassName; }                  \
-    static std::shared_ptr<ClassName> creator() {                     \
-      return std::make_shared<ClassName>();                           \
-    }                                                                 \
+// the state type by value: a constexpr constant's decltype is const.
+#define FSM_STATE_TRAITS(ClassName, StateType)                    \
+  struct traits {                                                 \
+    using type_t = std::decay<decltype(StateType)>::type;         \
+    static constexpr type_t type() { return StateType; }          \
+    static std::string name() { return #ClassName; }              \
+    static std::shared_ptr<ClassName> creator() {                 \
+      return std::make_shared<ClassName>();                       \
+    }                                                             \
+  }
+
+// a state nested in the composite state ParentClass.
+#define FSM_SUBSTATE_TRAITS(ClassName, StateType, ParentClass)    \
+  struct traits {                                                 \
+    using parent = ParentClass;                                   \
+    using type_t = std::decay<decltype(StateType)>::type;         \
+    static constexpr type_t type() { return StateType; }          \
+    static std::string name() { return #ClassName; }              \
+    static std::shared_ptr<ClassName> creator() {                 \
+      return std::make_shared<ClassName>();                       \
+    }                                                             \
   }
 
 }  // namespace utility
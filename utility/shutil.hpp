@@ -28,19 +28,51 @@ THE SOFTWARE.
 #if __cplusplus >= 201703L
 // msvc: add "/Zc:__cplusplus" to C/C++ cmdline.
 #include <filesystem>
+#include <string_view>
 namespace fs = std::filesystem;
 using error_code = std::error_code;
 #else
 #include <boost/filesystem.hpp>
+#include <boost/utility/string_view.hpp>
 namespace fs = boost::filesystem;
 using error_code = boost::system::error_code;
 #endif
 
+#include <algorithm>
+#include <atomic>
+#include <bitset>
+#include <condition_variable>
+#include <initializer_list>
+#include <iterator>
+#include <limits>
+#include <map>
 #include <cstring>
+#include <fstream>
+#include <future>
+#include <mutex>
 #include <regex>
+#include <set>
 #include <string>
+#include <unordered_map>
+#include <unordered_set>
 #include <vector>
 
+#include "event_queue.hpp"
+
+#ifdef __linux__
+#include <dirent.h>
+#include <fcntl.h>
+#include <linux/fs.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <cerrno>
+#endif  // __linux__
+
 namespace utility {
 
 // like python shutil module.
@@ -48,6 +80,12 @@ namespace shutil {
 
 using string_list = std::vector<std::string>;
 
+#if __cplusplus >= 201703L
+using string_view = std::string_view;
+#else
+using string_view = boost::string_view;
+#endif
+
 // test target(file|directory) exist or not.
 static bool is_exist(const std::string &p);
 
@@ -61,7 +99,8 @@ static std::string normalize(std::string p);
 // refer os.path.join
 static std::string path_join(std::string p1, std::string p2);
 
-// get target(file|directory) size
+// get target(file|directory) size. symlinks are followed and every hard
+// link counts, disk_usage() is the faster walk that does neither.
 static uint64_t get_file_size(std::string p);
 
 // target is directory or not.
@@ -77,22 +116,454 @@ static bool make_dir(const std::string &p);
 static bool copy_file(const std::string &src_file, const std::string &dest_dir,
                       const std::string &dest_file = "");
 
+// how copy_content() moves the bytes. automatic tries them in this order
+// and falls back to the next one the filesystem does not support.
+// other platforms than linux always use fs::copy_file.
+enum class copy_method {
+  automatic,
+  reflink,     // FICLONE: share the extents (btrfs, xfs), no data is copied.
+  copy_range,  // copy_file_range: in the kernel, server side on nfs/cifs.
+  sendfile,    // in the kernel, through the page cache.
+  buffered,    // read/write through a user space buffer.
+};
+
+// copy src_file->dest_file with its permissions, dest_file is overwritten.
+// holes of a sparse src_file are kept.
+static bool copy_content(const std::string &src_file,
+                         const std::string &dest_file, error_code &ec,
+                         copy_method method = copy_method::automatic);
+
 static bool skip(const std::string &check_item, const string_list &skip_items);
 
-// copy dir：src_dir/*->dest_dir/*；skip filename match any one of skip_items
+// shell style patterns, all of them compiled into one automaton:
+//   *      any characters but '/'.
+//   ?      one character but '/'.
+//   [a-z]  one character of the class, [!a-z] one that is not in it.
+//   **/    any number of directories, a trailing ** matches everything.
+//   \      escapes the next character (but on windows, where it is '/').
+// like .gitignore, a pattern without '/' matches the filename in any
+// directory, otherwise the path relative to the root. a trailing '/' only
+// matches directories. match() may be called from any thread, the dfa
+// states are built on first use and shared by the copies of a set.
+class pattern_set {
+ public:
+  pattern_set() {}
+  pattern_set(std::initializer_list<std::string> patterns)
+      : pattern_set(string_list(patterns)) {}
+  explicit pattern_set(const string_list &patterns);
+
+  bool empty() const { return starts_.empty(); }
+
+  // a pattern that matches name literally, '*', '?', '[' and '\\' included.
+  static std::string escape(const std::string &name);
+
+  // path relative to the root, '/' separated.
+  bool match(const std::string &path, bool is_dir = false) const {
+    return match(path.data(), path.size(), is_dir);
+  }
+  bool match(const char *path, size_t size, bool is_dir) const;
+
+ private:
+  struct node {
+    enum kind_type {
+      literal,
+      any,
+      char_class,
+      star,
+      dirs,         // **/ at a directory boundary.
+      dirs_inside,  // **/ inside a directory name.
+      all,          // a trailing **.
+      accept,
+    };
+
+    kind_type kind;
+    unsigned char c;
+    size_t cls;
+    bool dir_only;
+  };
+
+  using state_set = std::vector<uint32_t>;
+
+  // dfa_state::accept flags.
+  static constexpr uint8_t kAcceptAny = 1;
+  static constexpr uint8_t kAcceptDir = 2;
+
+  // dfa_state::next before the transition was built.
+  static constexpr uint32_t kUnknown = 0xffffffff;
+  // past this many dfa states, match() simulates the nfa for the rest of
+  // a path that needs a new one.
+  static constexpr size_t kMaxDfaStates = 8192;
+
+  struct dfa_state {
+    state_set set;
+    uint8_t accept;
+    bool dead;  // the empty set, nothing can match anymore.
+    std::unique_ptr<std::atomic<uint32_t>[]> next;  // per byte class.
+  };
+
+  // states never move once added, readers only take mtx to add one.
+  struct dfa {
+    std::mutex mtx;
+    std::map<state_set, uint32_t> ids;
+    std::vector<std::unique_ptr<dfa_state>> states;
+  };
+
+  static bool is_separator(unsigned char c) {
+#ifdef _WIN32
+    return c == '/' || c == '\\';
+#else
+    return c == '/';
+#endif  // _WIN32
+  }
+
+  void add(std::string pattern);
+  void push(node::kind_type kind, unsigned char c = 0, size_t cls = 0,
+            bool dir_only = false) {
+    nodes_.push_back(node{kind, c, cls, dir_only});
+  }
+
+  void closure(state_set &set) const;
+  state_set step(const state_set &set, unsigned char c) const;
+  uint8_t accepts(const state_set &set) const;
+  void build_byte_classes();
+  // kUnknown once the dfa is full. dfa_->mtx held.
+  uint32_t add_state(state_set set) const;
+  uint32_t add_transition(uint32_t state, uint8_t cls) const;
+
+  std::vector<node> nodes_;
+  std::vector<std::bitset<256>> classes_;
+  state_set starts_;
+
+  // bytes no pattern tells apart share a byte class.
+  uint8_t byte_class_[256];
+  std::vector<unsigned char> representative_;
+  std::shared_ptr<dfa> dfa_;
+};
+
+// copy dir：src_dir/*->dest_dir/*；skip filename equal to any one of
+// skip_items, compared literally (copy_options::skip_items are patterns).
+// false if any entry failed, see copy_tree().
 static bool copy_dir(const std::string &src_dir, const std::string &dest_dir,
                      const string_list &skip_items);
 
-// remove directory: if not exist, return true
+// which files copy_tree() copies over an existing destination file.
+enum class update_mode {
+  always,          // every file.
+  size_and_mtime,  // size or modification time differ, like rsync.
+  content,         // size or bytes differ.
+};
+
+struct copy_options {
+  // copies running at once, one per worker thread. small files are latency
+  // bound on nvme and network filesystems, more workers than cores pay off.
+  size_t max_in_flight{16};
+
+  // directories and files queued for the workers at most, 0 for unbounded.
+  // beyond that the thread that found them copies them itself.
+  size_t max_pending{4096};
+
+  // see pattern_set, a plain filename is skipped in every directory like
+  // copy_dir(). the extra entries delete_extra keeps are matched too.
+  string_list skip_items;
+
+  // other modes than always also give the copies the source's mtime, the
+  // next size_and_mtime sync skips them.
+  update_mode update{update_mode::always};
+
+  // remove what the destination has and the source has not, entries that
+  // match skip_items are kept.
+  bool delete_extra{false};
+};
+
+struct path_error {
+  std::string path;  // for copy_tree(), the source file or directory.
+  error_code ec;
+};
+
+struct copy_result {
+  uint64_t files{0};          // copied.
+  uint64_t dirs{0};
+  uint64_t bytes{0};          // copied.
+  uint64_t skipped_files{0};  // up to date, see update_mode.
+  uint64_t skipped_bytes{0};
+  uint64_t deleted{0};        // files and directories, see delete_extra.
+  std::vector<path_error> errors;
+
+  bool ok() const { return errors.empty(); }
+};
+
+// refer shutil.copytree: src_dir/*->dest_dir/*, directories are traversed
+// and files copied in parallel. a failed entry is reported in errors and
+// does not stop the others.
+static copy_result copy_tree(const std::string &src_dir,
+                             const std::string &dest_dir,
+                             const copy_options &opts = copy_options());
+
+// remove directory: if not exist, return true. see remove_tree().
 static bool remove_dir(const std::string &dir);
 
+struct remove_options {
+  // 0: unlink on the calling thread. N: N worker threads empty different
+  // directories at once, each directory goes once its entries are gone.
+  size_t threads{0};
+};
+
+struct remove_result {
+  uint64_t files{0};  // everything but directories.
+  uint64_t dirs{0};
+  std::vector<path_error> errors;
+
+  bool ok() const { return errors.empty(); }
+};
+
+// refer rm -rf: p and everything under it, symlinks are removed and not
+// followed. nothing to remove if p does not exist. linux unlinks with
+// unlinkat relative to the open directory, other platforms call fs::remove
+// per entry on the calling thread.
+static remove_result remove_tree(const std::string &p,
+                                 const remove_options &opts = remove_options());
+
+// moves p into trash_dir (created if needed, on the same filesystem) under
+// a unique name and returns, a background thread removes it from there.
+// the future is ready at once with the error if the move failed.
+static std::future<remove_result> remove_tree_later(
+    const std::string &p, const std::string &trash_dir,
+    const remove_options &opts = remove_options());
+
 // remove file：if not exist, return true
 static bool remove_file(const std::string &file);
 
-// scan files and directories under the target dir.
+// scan files and directories under the target dir, see walk().
 // refer python's glob module, not support regex.
 static string_list glob(const std::string &dir, bool recursive = false);
 
+enum class entry_type { file, directory, symlink, other };
+
+struct walk_entry {
+  const std::string &path;  // dir joined with the entry's relative path.
+  size_t name_offset;       // the filename starts at path[name_offset].
+  entry_type type;          // the target's type with follow_symlinks.
+  size_t depth;             // 0 for the entries of dir itself.
+
+  const char *name() const { return path.c_str() + name_offset; }
+};
+
+struct walk_options {
+  // 0: depth first on the calling thread, each entry before its children.
+  // N: N worker threads list the directories, the visitor is called from
+  // all of them at once.
+  size_t threads{0};
+
+  // descend into symlinks to directories, loops are not detected.
+  bool follow_symlinks{false};
+};
+
+// refer os.walk: visit(const walk_entry &) for everything under dir. a
+// directory is only entered if visit returns true for it. one path buffer
+// is reused, copy entry.path to keep it. linux reads the directories with
+// getdents64 and only stats the entries without a d_type.
+// returns the directories that could not be read.
+template <typename Visitor>
+static std::vector<path_error> walk(const std::string &dir, Visitor visit,
+                                    const walk_options &opts = walk_options());
+
+// refer unix find: what walk() finds under dir whose path relative to dir
+// matches include (everything if empty) and not exclude. excluded
+// directories are not entered.
+static string_list find(const std::string &dir, const pattern_set &include,
+                        const pattern_set &exclude = pattern_set());
+
+namespace detail {
+class usage_walker;
+}  // namespace detail
+
+// what disk_usage() learned about each directory: its own files' totals
+// and its subdirectories, valid while the directory's mtime is the same.
+// a file modified in place does not touch the mtime, its old size is
+// reported until an entry of its directory is added, removed or renamed.
+class usage_cache {
+ public:
+  size_t size() const {
+    std::lock_guard<std::mutex> guard(mtx_);
+    return dirs_.size();
+  }
+
+  void clear() {
+    std::lock_guard<std::mutex> guard(mtx_);
+    dirs_.clear();
+  }
+
+ private:
+  friend class detail::usage_walker;
+
+  // a file with more than one hard link.
+  struct link {
+    uint64_t dev;
+    uint64_t ino;
+    uint64_t bytes;
+    uint64_t allocated;
+  };
+
+  struct dir {
+    int64_t mtime;
+    uint64_t ino;
+    uint64_t bytes{0};
+    uint64_t allocated{0};
+    uint64_t files{0};
+    std::vector<link> links;
+    string_list subdirs;
+  };
+
+  mutable std::mutex mtx_;
+  std::unordered_map<std::string, dir> dirs_;
+};
+
+struct usage_options {
+  // like walk_options::threads.
+  size_t threads{0};
+
+  // a file with several hard links in the tree is counted once. linux
+  // only, other platforms count every link.
+  bool count_links_once{true};
+
+  // see usage_cache, it may be shared by concurrent queries.
+  usage_cache *cache{nullptr};
+};
+
+struct usage_result {
+  uint64_t bytes{0};      // apparent size of the regular files.
+  uint64_t allocated{0};  // blocks on disk, with the directories, like du.
+  uint64_t files{0};      // everything but directories.
+  uint64_t dirs{0};
+  std::vector<path_error> errors;
+};
+
+// refer du: the size of everything under p, symlinks are not followed.
+// linux stats the entries with fstatat relative to their directory.
+static usage_result disk_usage(const std::string &p,
+                               const usage_options &opts = usage_options());
+
+// splits a buffer into records without copying: the text up to each delim,
+// delim not included. like std::getline, a trailing delim does not start
+// an empty record. the views point into the buffer.
+class record_range {
+ public:
+  class iterator {
+   public:
+    using iterator_category = std::forward_iterator_tag;
+    using value_type = string_view;
+    using difference_type = std::ptrdiff_t;
+    using pointer = const string_view *;
+    using reference = const string_view &;
+
+    iterator() {}
+
+    reference operator*() const { return record_; }
+    pointer operator->() const { return &record_; }
+
+    iterator &operator++() {
+      auto next = record_.data() + record_.size();
+      if (next == end_ || ++next == end_)
+        record_ = string_view();
+      else
+        find(next);
+      return *this;
+    }
+
+    iterator operator++(int) {
+      auto it = *this;
+      ++*this;
+      return it;
+    }
+
+    bool operator==(const iterator &other) const {
+      return record_.data() == other.record_.data();
+    }
+    bool operator!=(const iterator &other) const { return !(*this == other); }
+
+   private:
+    friend class record_range;
+
+    iterator(const char *begin, const char *end, char delim)
+        : end_(end), delim_(delim) {
+      if (begin != end)
+        find(begin);
+    }
+
+    void find(const char *begin) {
+      auto found = static_cast<const char *>(
+          std::memchr(begin, delim_, static_cast<size_t>(end_ - begin)));
+      record_ = string_view(begin, (found ? found : end_) - begin);
+    }
+
+    // data() is nullptr at the end.
+    string_view record_;
+    const char *end_{nullptr};
+    char delim_{'\n'};
+  };
+
+  explicit record_range(string_view data, char delim = '\n')
+      : data_(data), delim_(delim) {}
+
+  iterator begin() const {
+    return iterator(data_.data(), data_.data() + data_.size(), delim_);
+  }
+  iterator end() const { return iterator(); }
+
+ private:
+  string_view data_;
+  char delim_;
+};
+
+enum class access_hint { normal, sequential, random };
+
+// a whole file in memory, read only. linux maps regular files with mmap
+// and passes the hint to madvise. files that can not be mapped (pipes,
+// /proc, other platforms) are read into a buffer until eof instead.
+class mapped_file {
+ public:
+  mapped_file() {}
+  explicit mapped_file(const std::string &p,
+                       access_hint hint = access_hint::sequential) {
+    open(p, hint);
+  }
+  ~mapped_file() { close(); }
+
+  mapped_file(const mapped_file &) = delete;
+  mapped_file &operator=(const mapped_file &) = delete;
+  mapped_file(mapped_file &&other) { *this = std::move(other); }
+  mapped_file &operator=(mapped_file &&other);
+
+  // false with error() set if p could not be read.
+  bool open(const std::string &p, access_hint hint = access_hint::sequential);
+  void close();
+
+  bool is_open() const { return open_; }
+  const error_code &error() const { return ec_; }
+  // false if the contents were read into a buffer.
+  bool mapped() const { return map_ != nullptr; }
+
+  const char *data() const {
+    return map_ ? static_cast<const char *>(map_) : buffer_.data();
+  }
+  size_t size() const { return map_ ? size_ : buffer_.size(); }
+  string_view view() const { return string_view(data(), size()); }
+
+  record_range lines(char delim = '\n') const {
+    return record_range(view(), delim);
+  }
+
+ private:
+  bool read(const std::string &p);
+  void set_io_error();
+
+  void *map_{nullptr};
+  size_t size_{0};
+  std::string buffer_;
+  bool open_{false};
+  error_code ec_;
+};
+
 }  // namespace shutil
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -176,9 +647,215 @@ static bool copy_file(const std::string &src_file, const std::string &dest_dir,
     dest_path /= src_path.filename();
 
   error_code ec;
+  return copy_content(src_path.string(), dest_path.string(), ec);
+}
+
+namespace detail {
 
+#ifdef __linux__
+static void set_errno(error_code &ec, int err) {
+#if __cplusplus >= 201703L
+  ec.assign(err, std::system_category());
+#else
+  ec.assign(err, boost::system::system_category());
+#endif
+}
+
+class file_descriptor {
+ public:
+  explicit file_descriptor(int fd) : fd_(fd) {}
+  ~file_descriptor() {
+    if (fd_ >= 0)
+      ::close(fd_);
+  }
+
+  file_descriptor(const file_descriptor &) = delete;
+  file_descriptor &operator=(const file_descriptor &) = delete;
+
+  int get() const { return fd_; }
+
+ private:
+  int fd_;
+};
+
+// the filesystem or kernel does not support the method for these files.
+static bool unsupported(int err) {
+  return err == ENOSYS || err == EXDEV || err == EINVAL ||
+         err == EOPNOTSUPP || err == ENOTTY || err == EBADF;
+}
+
+static int buffered_range(int in, int out, off_t offset, off_t len) {
+  std::vector<char> buffer(
+      static_cast<size_t>(std::min<off_t>(len, 128 * 1024)));
+  while (len > 0) {
+    auto n = ::pread(in, buffer.data(),
+                     static_cast<size_t>(std::min<off_t>(len, buffer.size())),
+                     offset);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      return n < 0 ? errno : 0;
+
+    for (ssize_t written = 0; written < n;) {
+      auto w = ::pwrite(out, buffer.data() + written,
+                        static_cast<size_t>(n - written), offset + written);
+      if (w < 0 && errno == EINTR)
+        continue;
+      if (w < 0)
+        return errno;
+      written += w;
+    }
+    offset += n;
+    len -= n;
+  }
+  return 0;
+}
+
+// copies [offset, offset + len) of in to the same offset of out. automatic
+// is narrowed to the method that worked, the next range starts there.
+static int copy_range(int in, int out, off_t offset, off_t len,
+                      copy_method &method) {
+  constexpr off_t kChunk = off_t(1) << 30;
+  auto fallback = method == copy_method::automatic;
+
+  if (method == copy_method::automatic || method == copy_method::copy_range) {
+    auto in_off = offset;
+    auto out_off = offset;
+    while (len > 0) {
+      auto n = ::copy_file_range(in, &in_off, out, &out_off,
+                                 static_cast<size_t>(std::min(len, kChunk)),
+                                 0);
+      if (n < 0 && errno == EINTR)
+        continue;
+      if (n < 0 && fallback && unsupported(errno) && in_off == offset) {
+        method = copy_method::sendfile;
+        break;
+      }
+      if (n <= 0)
+        return n < 0 ? errno : 0;
+
+      method = copy_method::copy_range;
+      len -= n;
+    }
+    if (len == 0)
+      return 0;
+  }
+
+  if (method == copy_method::sendfile) {
+    auto in_off = offset;
+    if (::lseek(out, offset, SEEK_SET) < 0)
+      return errno;
+
+    while (len > 0) {
+      auto n = ::sendfile(out, in, &in_off,
+                          static_cast<size_t>(std::min(len, kChunk)));
+      if (n < 0 && errno == EINTR)
+        continue;
+      if (n < 0 && fallback && unsupported(errno) && in_off == offset) {
+        method = copy_method::buffered;
+        break;
+      }
+      if (n <= 0)
+        return n < 0 ? errno : 0;
+
+      len -= n;
+    }
+    if (len == 0)
+      return 0;
+  }
+
+  return buffered_range(in, out, offset, len);
+}
+
+// only the data of a sparse file is copied, the holes are left in out.
+static int copy_data(int in, int out, off_t size, bool sparse,
+                     copy_method method) {
+  if (!sparse)
+    return copy_range(in, out, 0, size, method);
+
+  off_t pos = 0;
+  while (pos < size) {
+    auto data = ::lseek(in, pos, SEEK_DATA);
+    if (data < 0 && errno == ENXIO)
+      break;  // a hole up to the end.
+    if (data < 0)
+      return copy_range(in, out, pos, size - pos, method);
+
+    auto hole = ::lseek(in, data, SEEK_HOLE);
+    if (hole < 0)
+      return errno;
+
+    auto err = copy_range(in, out, data, hole - data, method);
+    if (err)
+      return err;
+    pos = hole;
+  }
+  return ::ftruncate(out, size) < 0 ? errno : 0;
+}
+
+static int kernel_copy(const std::string &src, const std::string &dest,
+                       copy_method method) {
+  file_descriptor in(::open(src.c_str(), O_RDONLY | O_CLOEXEC));
+  if (in.get() < 0)
+    return errno;
+
+  struct stat st;
+  if (::fstat(in.get(), &st) < 0)
+    return errno;
+  if (S_ISDIR(st.st_mode))
+    return EISDIR;
+
+  file_descriptor out(::open(dest.c_str(), O_WRONLY | O_CREAT | O_CLOEXEC,
+                             st.st_mode & 0777));
+  if (out.get() < 0)
+    return errno;
+
+  // truncating dest must not empty src, refer fs::copy_file.
+  struct stat dest_st;
+  if (::fstat(out.get(), &dest_st) < 0)
+    return errno;
+  if (dest_st.st_dev == st.st_dev && dest_st.st_ino == st.st_ino)
+    return EEXIST;
+  if (::ftruncate(out.get(), 0) < 0)
+    return errno;
+
+  if (::fchmod(out.get(), st.st_mode & 07777) < 0)
+    return errno;
+
+  if (method == copy_method::automatic || method == copy_method::reflink) {
+#ifdef FICLONE
+    if (::ioctl(out.get(), FICLONE, in.get()) == 0)
+      return 0;
+    if (method == copy_method::reflink || !unsupported(errno))
+      return errno;
+#else
+    if (method == copy_method::reflink)
+      return EOPNOTSUPP;
+#endif  // FICLONE
+  }
+
+  // fewer blocks than the size needs: there are holes.
+  auto sparse = static_cast<off_t>(st.st_blocks) * 512 < st.st_size;
+  return copy_data(in.get(), out.get(), st.st_size, sparse, method);
+}
+#endif  // __linux__
+
+}  // namespace detail
+
+static bool copy_content(const std::string &src_file,
+                         const std::string &dest_file, error_code &ec,
+                         copy_method method) {
+#ifdef __linux__
+  ec.clear();
+  auto err = detail::kernel_copy(src_file, dest_file, method);
+  if (err)
+    detail::set_errno(ec, err);
+  return !err;
+#else
+  (void)method;
   auto opt = fs::copy_options::overwrite_existing;
-  return fs::copy_file(src_path, dest_path, opt, ec);
+  return fs::copy_file(fs::path{src_file}, fs::path{dest_file}, opt, ec);
+#endif  // __linux__
 }
 
 // static bool copy_dir(const std::string &src_dir, const std::string &dest_dir)
@@ -201,31 +878,540 @@ static bool skip(const std::string &check_item, const string_list &skip_items) {
   return false;
 }
 
+inline std::string pattern_set::escape(const std::string &name) {
+  std::string pattern;
+  for (auto c : name) {
+    // a class of one character needs no escape character, which windows
+    // takes for a separator.
+    if (c == '*' || c == '?' || c == '[' || c == '\\')
+      pattern.append(1, '[').append(1, c).append(1, ']');
+    else
+      pattern += c;
+  }
+  return pattern;
+}
+
+inline pattern_set::pattern_set(const string_list &patterns)
+    : dfa_(std::make_shared<dfa>()) {
+  for (auto &pattern : patterns) {
+    add(pattern);
+  }
+
+  build_byte_classes();
+  dfa_->states.reserve(kMaxDfaStates);
+  auto start = starts_;
+  closure(start);
+  add_state(start);
+}
+
+inline void pattern_set::add(std::string pattern) {
+  auto dir_only = false;
+  while (pattern.size() > 1 && is_separator(pattern.back())) {
+    pattern.pop_back();
+    dir_only = true;
+  }
+
+  auto anchored = false;
+  for (auto c : pattern) {
+    anchored = anchored || is_separator(static_cast<unsigned char>(c));
+  }
+  if (!pattern.empty() && is_separator(pattern[0]))
+    pattern.erase(0, 1);
+
+  auto start = nodes_.size();
+  starts_.push_back(static_cast<uint32_t>(start));
+  if (!anchored) {
+    push(node::dirs);
+    push(node::dirs_inside);
+  }
+
+  auto n = pattern.size();
+  for (size_t i = 0; i < n; ++i) {
+    auto c = static_cast<unsigned char>(pattern[i]);
+    auto boundary = i == 0 || is_separator(pattern[i - 1]);
+    if (c == '*' && i + 1 < n && pattern[i + 1] == '*' && boundary) {
+      if (i + 2 == n) {
+        push(node::all);
+        ++i;
+        continue;
+      }
+      if (is_separator(pattern[i + 2])) {
+        push(node::dirs);
+        push(node::dirs_inside);
+        i += 2;
+        continue;
+      }
+    }
+
+    if (c == '*') {
+      if (nodes_.size() == start || nodes_.back().kind != node::star)
+        push(node::star);
+    }
+    else if (c == '?') {
+      push(node::any);
+    }
+    else if (c == '[') {
+      auto j = i + 1;
+      auto negate = j < n && (pattern[j] == '!' || pattern[j] == '^');
+      if (negate)
+        ++j;
+
+      std::bitset<256> bits;
+      for (auto first = true; j < n && (pattern[j] != ']' || first);
+           first = false) {
+        auto lo = static_cast<unsigned char>(pattern[j]);
+        if (j + 2 < n && pattern[j + 1] == '-' && pattern[j + 2] != ']') {
+          auto hi = static_cast<unsigned char>(pattern[j + 2]);
+          for (unsigned v = lo; v <= hi; ++v) {
+            bits.set(v);
+          }
+          j += 3;
+        }
+        else {
+          bits.set(lo);
+          ++j;
+        }
+      }
+
+      // no closing ']': a plain '['.
+      if (j >= n) {
+        push(node::literal, c);
+        continue;
+      }
+      if (negate)
+        bits.flip();
+      classes_.push_back(bits);
+      push(node::char_class, 0, classes_.size() - 1);
+      i = j;
+    }
+    else if (c == '\\' && !is_separator(c) && i + 1 < n) {
+      push(node::literal, static_cast<unsigned char>(pattern[++i]));
+    }
+    else {
+      push(node::literal, is_separator(c) ? '/' : c);
+    }
+  }
+  push(node::accept, 0, 0, dir_only);
+}
+
+// adds the states reachable without a character, sorted.
+inline void pattern_set::closure(state_set &set) const {
+  for (size_t i = 0; i < set.size(); ++i) {
+    auto s = set[i];
+    switch (nodes_[s].kind) {
+      case node::star:
+      case node::all:
+        set.push_back(s + 1);
+        break;
+      case node::dirs:
+        set.push_back(s + 2);
+        break;
+      default:
+        break;
+    }
+  }
+  std::sort(set.begin(), set.end());
+  set.erase(std::unique(set.begin(), set.end()), set.end());
+}
+
+inline pattern_set::state_set pattern_set::step(const state_set &set,
+                                                unsigned char c) const {
+  auto sep = is_separator(c);
+  state_set next;
+  for (auto s : set) {
+    auto &n = nodes_[s];
+    switch (n.kind) {
+      case node::literal:
+        if (n.c == c || (sep && n.c == '/'))
+          next.push_back(s + 1);
+        break;
+      case node::any:
+        if (!sep)
+          next.push_back(s + 1);
+        break;
+      case node::char_class:
+        if (!sep && classes_[n.cls][c])
+          next.push_back(s + 1);
+        break;
+      case node::star:
+        if (!sep)
+          next.push_back(s);
+        break;
+      case node::dirs:
+        next.push_back(sep ? s : s + 1);
+        break;
+      case node::dirs_inside:
+        next.push_back(sep ? s - 1 : s);
+        break;
+      case node::all:
+        next.push_back(s);
+        break;
+      case node::accept:
+        break;
+    }
+  }
+  closure(next);
+  return next;
+}
+
+inline uint8_t pattern_set::accepts(const state_set &set) const {
+  uint8_t flags = 0;
+  for (auto s : set) {
+    if (nodes_[s].kind != node::accept)
+      continue;
+
+    if (nodes_[s].dir_only)
+      flags |= kAcceptDir;
+    else
+      flags |= kAcceptAny;
+  }
+  return flags;
+}
+
+inline void pattern_set::build_byte_classes() {
+  std::map<std::string, uint8_t> signatures;
+  for (unsigned c = 0; c < 256; ++c) {
+    auto byte = static_cast<unsigned char>(c);
+    std::string signature(1, is_separator(byte) ? 's' : '-');
+    for (auto &n : nodes_) {
+      if (n.kind == node::literal)
+        signature += n.c == byte ? '1' : '0';
+    }
+    for (auto &bits : classes_) {
+      signature += bits[byte] ? '1' : '0';
+    }
+
+    auto it = signatures.find(signature);
+    if (it == signatures.end()) {
+      it = signatures
+               .emplace(signature, static_cast<uint8_t>(signatures.size()))
+               .first;
+      representative_.push_back(byte);
+    }
+    byte_class_[c] = it->second;
+  }
+}
+
+inline uint32_t pattern_set::add_state(state_set set) const {
+  auto it = dfa_->ids.find(set);
+  if (it != dfa_->ids.end())
+    return it->second;
+
+  auto &states = dfa_->states;
+  if (states.size() >= kMaxDfaStates)
+    return kUnknown;
+
+  auto classes = representative_.size();
+  std::unique_ptr<dfa_state> state(new dfa_state());
+  state->accept = accepts(set);
+  state->dead = set.empty();
+  state->next.reset(new std::atomic<uint32_t>[classes]);
+  for (size_t i = 0; i < classes; ++i) {
+    state->next[i].store(kUnknown, std::memory_order_relaxed);
+  }
+  state->set = set;
+
+  auto id = static_cast<uint32_t>(states.size());
+  states.push_back(std::move(state));
+  dfa_->ids.emplace(std::move(set), id);
+  return id;
+}
+
+inline uint32_t pattern_set::add_transition(uint32_t state,
+                                            uint8_t cls) const {
+  std::lock_guard<std::mutex> guard(dfa_->mtx);
+  auto &from = *dfa_->states[state];
+  auto next = from.next[cls].load(std::memory_order_relaxed);
+  if (next != kUnknown)
+    return next;
+
+  next = add_state(step(from.set, representative_[cls]));
+  if (next != kUnknown)
+    from.next[cls].store(next, std::memory_order_release);
+  return next;
+}
+
+inline bool pattern_set::match(const char *path, size_t size,
+                               bool is_dir) const {
+  if (starts_.empty())
+    return false;
+
+  // the states vector never reallocates, see the constructor.
+  auto states = dfa_->states.data();
+  uint32_t state = 0;
+  size_t i = 0;
+  for (; i < size && !states[state]->dead; ++i) {
+    auto cls = byte_class_[static_cast<unsigned char>(path[i])];
+    auto next = states[state]->next[cls].load(std::memory_order_acquire);
+    if (next == kUnknown)
+      next = add_transition(state, cls);
+    if (next == kUnknown)
+      break;
+    state = next;
+  }
+
+  auto flags = states[state]->accept;
+  if (i < size && !states[state]->dead) {
+    // the dfa is full: the nfa takes the rest of the path.
+    auto set = states[state]->set;
+    for (; i < size && !set.empty(); ++i) {
+      set = step(set, static_cast<unsigned char>(path[i]));
+    }
+    flags = accepts(set);
+  }
+
+  return (flags & kAcceptAny) || (is_dir && (flags & kAcceptDir));
+}
+
 static bool copy_dir(const std::string &src_dir, const std::string &dest_dir,
                      const string_list &skip_items) {
-  auto dest_path = fs::path{dest_dir};
-  for (auto &dir_entry : fs::directory_iterator(fs::path{src_dir})) {
-    auto dir_path = dir_entry.path();
-    auto filename = dir_path.filename().string();
-    if (filename == "." || filename == "..")
-      continue;
+  copy_options opts;
+  for (auto &item : skip_items) {
+    // a path never matched a filename.
+    if (fs::path{item}.filename().string() == item)
+      opts.skip_items.push_back(pattern_set::escape(item));
+  }
+  return copy_tree(src_dir, dest_dir, opts).ok();
+}
 
-    if (skip(filename, skip_items))
-      continue;
+namespace detail {
+
+// tasks on a function_queue that spawn more tasks, wait() returns once all
+// of them are done.
+class task_group {
+ public:
+  // max_pending: tasks queued at most, 0 for unbounded.
+  task_group(size_t threads, size_t max_pending)
+      : queue_(queue_options(threads, max_pending)) {}
+
+  // runs the task inline once the queue is full, the workers never block
+  // on each other.
+  template <typename F>
+  void spawn(F fn) {
+    pending_.fetch_add(1);
+    auto task = [this, fn]() {
+      fn();
+      finish();
+    };
+    if (!queue_.try_enqueue(inline_event(task)))
+      task();
+  }
 
-    auto result = false;
-    if (fs::is_directory(dir_path)) {
-      auto dest_file = (dest_path / filename).string();
-      result = copy_dir(dir_path.string(), dest_file, skip_items);
+  void wait() {
+    {
+      std::unique_lock<std::mutex> locker(mtx_);
+      done_cv_.wait(locker, [this]() { return pending_.load() == 0; });
     }
-    else
-      result = copy_file(dir_path.string(), dest_dir);
+    queue_.stop();
+  }
+
+ private:
+  static event_queue_options queue_options(size_t threads,
+                                           size_t max_pending) {
+    event_queue_options opts;
+    opts.thread_count = std::max<size_t>(threads, 1);
+    opts.capacity = max_pending;
+    return opts;
+  }
+
+  void finish() {
+    if (pending_.fetch_sub(1) != 1)
+      return;
+
+    std::lock_guard<std::mutex> guard(mtx_);
+    done_cv_.notify_all();
+  }
+
+  function_queue queue_;
+  std::atomic<size_t> pending_{0};
+  std::mutex mtx_;
+  std::condition_variable done_cv_;
+};
+
+// the directories and files of one copy_tree() are tasks, a directory task
+// spawns a task for each of its entries.
+class tree_copier {
+ public:
+  explicit tree_copier(const copy_options &opts)
+      : opts_(opts),
+        skip_(opts.skip_items),
+        tasks_(opts.max_in_flight, opts.max_pending) {}
+
+  copy_result run(const fs::path &src, const fs::path &dest) {
+    tasks_.spawn([this, src, dest]() { copy_dir(src, dest, std::string()); });
+    tasks_.wait();
+
+    result_.files = files_.load();
+    result_.dirs = dirs_.load();
+    result_.bytes = bytes_.load();
+    result_.skipped_files = skipped_files_.load();
+    result_.skipped_bytes = skipped_bytes_.load();
+    result_.deleted = deleted_.load();
+    return std::move(result_);
+  }
+
+ private:
+  void fail(const fs::path &p, const error_code &ec) {
+    std::lock_guard<std::mutex> guard(mtx_);
+    result_.errors.push_back(path_error{p.string(), ec});
+  }
+
+  // rel: the path of src relative to the root, what skip_items match.
+  void copy_dir(const fs::path &src, const fs::path &dest,
+                const std::string &rel) {
+    error_code ec;
+    fs::directory_iterator it(src, ec), end;
+    if (!ec)
+      fs::create_directories(dest, ec);
+    if (ec) {
+      fail(src, ec);
+      return;
+    }
+    dirs_.fetch_add(1, std::memory_order_relaxed);
+
+    std::unordered_set<std::string> names;
+    for (; !ec && it != end; it.increment(ec)) {
+      auto child = it->path();
+      auto filename = child.filename().string();
+      if (filename == "." || filename == "..")
+        continue;
+
+      error_code status_ec;
+      auto is_dir = fs::is_directory(it->status(status_ec));
+      auto child_rel = rel.empty() ? filename : rel + '/' + filename;
+      if (skip_.match(child_rel, is_dir))
+        continue;
+
+      if (opts_.delete_extra)
+        names.insert(filename);
+
+      auto target = dest / child.filename();
+      if (is_dir)
+        tasks_.spawn([this, child, target, child_rel]() {
+          copy_dir(child, target, child_rel);
+        });
+      else
+        tasks_.spawn([this, child, target]() { copy_file(child, target); });
+    }
+
+    if (ec)
+      fail(src, ec);
+    else if (opts_.delete_extra)
+      delete_extra(dest, rel, names);
+  }
+
+  // the source listing is complete, names holds everything it copies.
+  void delete_extra(const fs::path &dest, const std::string &rel,
+                    const std::unordered_set<std::string> &names) {
+    error_code ec;
+    fs::directory_iterator it(dest, ec), end;
+    std::vector<fs::path> extra;
+    for (; !ec && it != end; it.increment(ec)) {
+      auto filename = it->path().filename().string();
+      if (names.count(filename))
+        continue;
+
+      error_code status_ec;
+      auto is_dir = fs::is_directory(it->symlink_status(status_ec));
+      auto child_rel = rel.empty() ? filename : rel + '/' + filename;
+      if (!skip_.match(child_rel, is_dir))
+        extra.push_back(it->path());
+    }
+
+    for (auto &p : extra) {
+      error_code remove_ec;
+      auto count = fs::remove_all(p, remove_ec);
+      if (remove_ec)
+        fail(p, remove_ec);
+      else
+        deleted_.fetch_add(count, std::memory_order_relaxed);
+    }
+
+    if (ec)
+      fail(dest, ec);
+  }
+
+  void copy_file(const fs::path &src, const fs::path &dest) {
+    error_code ec;
+    auto size = fs::file_size(src, ec);
+    if (ec) {
+      fail(src, ec);
+      return;
+    }
+
+    if (opts_.update != update_mode::always && up_to_date(src, dest, size)) {
+      skipped_files_.fetch_add(1, std::memory_order_relaxed);
+      skipped_bytes_.fetch_add(size, std::memory_order_relaxed);
+      return;
+    }
+
+    if (!copy_content(src.string(), dest.string(), ec)) {
+      fail(src, ec);
+      return;
+    }
+
+    if (opts_.update != update_mode::always) {
+      fs::last_write_time(dest, fs::last_write_time(src, ec), ec);
+      if (ec)
+        fail(src, ec);
+    }
+
+    files_.fetch_add(1, std::memory_order_relaxed);
+    bytes_.fetch_add(size, std::memory_order_relaxed);
+  }
 
-    if (!result)
+  bool up_to_date(const fs::path &src, const fs::path &dest, uint64_t size) {
+    error_code ec;
+    if (fs::file_size(dest, ec) != size || ec)
       return false;
+
+    if (opts_.update == update_mode::size_and_mtime) {
+      auto src_time = fs::last_write_time(src, ec);
+      return !ec && fs::last_write_time(dest, ec) == src_time && !ec;
+    }
+    return same_content(src, dest);
   }
 
-  return true;
+  // both files have the same size.
+  static bool same_content(const fs::path &a, const fs::path &b) {
+    std::ifstream in_a(a.string(), std::ios::binary);
+    std::ifstream in_b(b.string(), std::ios::binary);
+    if (!in_a || !in_b)
+      return false;
+
+    std::vector<char> buf_a(64 * 1024), buf_b(64 * 1024);
+    while (in_a && in_b) {
+      in_a.read(buf_a.data(), buf_a.size());
+      in_b.read(buf_b.data(), buf_b.size());
+      if (in_a.gcount() != in_b.gcount() ||
+          std::memcmp(buf_a.data(), buf_b.data(),
+                      static_cast<size_t>(in_a.gcount())) != 0)
+        return false;
+    }
+    return true;
+  }
+
+  const copy_options &opts_;
+  pattern_set skip_;
+  task_group tasks_;
+  std::mutex mtx_;
+
+  std::atomic<uint64_t> files_{0};
+  std::atomic<uint64_t> dirs_{0};
+  std::atomic<uint64_t> bytes_{0};
+  std::atomic<uint64_t> skipped_files_{0};
+  std::atomic<uint64_t> skipped_bytes_{0};
+  std::atomic<uint64_t> deleted_{0};
+  copy_result result_;
+};
+
+}  // namespace detail
+
+static copy_result copy_tree(const std::string &src_dir,
+                             const std::string &dest_dir,
+                             const copy_options &opts) {
+  detail::tree_copier copier(opts);
+  return copier.run(fs::path{src_dir}, fs::path{dest_dir});
 }
 
 static bool remove_dir(const std::string &dir) {
@@ -235,9 +1421,7 @@ static bool remove_dir(const std::string &dir) {
   if (!is_dir(dir))
     return false;
 
-  error_code ec;
-  fs::remove_all(fs::path{dir}, ec);
-  return !ec;
+  return remove_tree(dir).ok();
 }
 
 static bool remove_file(const std::string &file) {
@@ -246,28 +1430,971 @@ static bool remove_file(const std::string &file) {
   return !ec;
 }
 
+namespace detail {
+
+#ifdef __linux__
+struct linux_dirent64 {
+  uint64_t d_ino;
+  int64_t d_off;
+  unsigned short d_reclen;
+  unsigned char d_type;
+  char d_name[1];
+};
+
+// lists a directory with getdents64, the d_type hint saves the stat of
+// most entries.
+class dir_reader {
+ public:
+  static constexpr char kSeparator = '/';
+
+  // the subdirectory name of parent, or path without a parent. follow:
+  // report the type of a symlink's target.
+  dir_reader(const dir_reader *parent, const char *name,
+             const std::string &path, bool follow)
+      : follow_(follow), buffer_(new char[kBufferSize]) {
+    auto flags = O_RDONLY | O_DIRECTORY | O_CLOEXEC;
+    if (parent)
+      fd_ = ::openat(parent->fd_, name, flags | (follow ? 0 : O_NOFOLLOW));
+    else
+      fd_ = ::open(path.c_str(), flags);
+    if (fd_ < 0)
+      set_errno(ec_, errno);
+  }
+
+  // reads the open directory dir, which must outlive the reader.
+  dir_reader(const file_descriptor &dir, bool follow)
+      : fd_(dir.get()),
+        owned_(false),
+        follow_(follow),
+        buffer_(new char[kBufferSize]) {}
+
+  ~dir_reader() {
+    if (owned_ && fd_ >= 0)
+      ::close(fd_);
+  }
+
+  dir_reader(const dir_reader &) = delete;
+  dir_reader &operator=(const dir_reader &) = delete;
+
+  const error_code &error() const { return ec_; }
+  int fd() const { return fd_; }
+
+  // false at the end or on an error. name lives until the next call.
+  bool next(const char *&name, entry_type &type) {
+    while (true) {
+      if (pos_ >= end_) {
+        if (fd_ < 0)
+          return false;
+
+        auto n = ::syscall(SYS_getdents64, fd_, buffer_.get(), kBufferSize);
+        if (n < 0 && errno == EINTR)
+          continue;
+        if (n < 0)
+          set_errno(ec_, errno);
+        if (n <= 0)
+          return false;
+
+        pos_ = 0;
+        end_ = static_cast<size_t>(n);
+      }
+
+      auto entry = reinterpret_cast<linux_dirent64 *>(buffer_.get() + pos_);
+      pos_ += entry->d_reclen;
+
+      name = entry->d_name;
+      if (name[0] == '.' &&
+          (name[1] == '\0' || (name[1] == '.' && name[2] == '\0')))
+        continue;
+
+      type = type_of(entry->d_type, name);
+      return true;
+    }
+  }
+
+ private:
+  static constexpr size_t kBufferSize = 32 * 1024;
+
+  entry_type type_of(unsigned char d_type, const char *name) const {
+    switch (d_type) {
+      case DT_REG:
+        return entry_type::file;
+      case DT_DIR:
+        return entry_type::directory;
+      case DT_LNK:
+        if (!follow_)
+          return entry_type::symlink;
+        break;
+      case DT_UNKNOWN:
+        break;
+      default:
+        return entry_type::other;
+    }
+
+    struct stat st;
+    if (::fstatat(fd_, name, &st, follow_ ? 0 : AT_SYMLINK_NOFOLLOW) < 0)
+      return d_type == DT_LNK ? entry_type::symlink : entry_type::other;
+
+    if (S_ISREG(st.st_mode))
+      return entry_type::file;
+    if (S_ISDIR(st.st_mode))
+      return entry_type::directory;
+    if (S_ISLNK(st.st_mode))
+      return entry_type::symlink;
+    return entry_type::other;
+  }
+
+  int fd_{-1};
+  bool owned_{true};
+  bool follow_;
+  error_code ec_;
+  std::unique_ptr<char[]> buffer_;
+  size_t pos_{0};
+  size_t end_{0};
+};
+#else
+class dir_reader {
+ public:
+  static constexpr char kSeparator = static_cast<char>(
+      fs::path::preferred_separator);
+
+  dir_reader(const dir_reader *, const char *, const std::string &path,
+             bool follow)
+      : it_(fs::path{path}, ec_), follow_(follow) {}
+
+  const error_code &error() const { return ec_; }
+
+  bool next(const char *&name, entry_type &type) {
+    if (started_ && !ec_ && it_ != end_)
+      it_.increment(ec_);
+    started_ = true;
+    if (ec_ || it_ == end_)
+      return false;
+
+    name_ = it_->path().filename().string();
+    name = name_.c_str();
+
+    error_code ec;
+    auto status = follow_ ? it_->status(ec) : it_->symlink_status(ec);
+    if (fs::is_regular_file(status))
+      type = entry_type::file;
+    else if (fs::is_directory(status))
+      type = entry_type::directory;
+    else if (fs::is_symlink(status))
+      type = entry_type::symlink;
+    else
+      type = entry_type::other;
+    return true;
+  }
+
+ private:
+  error_code ec_;
+  fs::directory_iterator it_, end_;
+  bool follow_;
+  bool started_{false};
+  std::string name_;
+};
+#endif  // __linux__
+
+template <typename Visitor>
+class walker {
+ public:
+  walker(Visitor &visit, const walk_options &opts)
+      : visit_(visit), opts_(opts) {
+    if (opts.threads > 0)
+      tasks_.reset(new task_group(opts.threads, 4096));
+  }
+
+  std::vector<path_error> run(const std::string &dir) {
+    if (tasks_) {
+      tasks_->spawn([this, dir]() { walk_path(dir, 0); });
+      tasks_->wait();
+    }
+    else {
+      std::string path = dir;
+      dir_reader reader(nullptr, nullptr, path, opts_.follow_symlinks);
+      walk_dir(reader, path, 0);
+    }
+    return std::move(errors_);
+  }
+
+ private:
+  void walk_path(std::string path, size_t depth) {
+    dir_reader reader(nullptr, nullptr, path, opts_.follow_symlinks);
+    walk_dir(reader, path, depth);
+  }
+
+  // path is the directory of reader on entry and on return.
+  void walk_dir(dir_reader &reader, std::string &path, size_t depth) {
+    auto dir_size = path.size();
+    if (!path.empty() && path.back() != '/' &&
+        path.back() != dir_reader::kSeparator)
+      path += dir_reader::kSeparator;
+
+    auto base = path.size();
+    const char *name = nullptr;
+    auto type = entry_type::other;
+    while (reader.next(name, type)) {
+      path.resize(base);
+      path += name;
+      if (!visit_(walk_entry{path, base, type, depth}) ||
+          type != entry_type::directory)
+        continue;
+
+      if (tasks_) {
+        auto child = path;
+        tasks_->spawn([this, child, depth]() { walk_path(child, depth + 1); });
+      }
+      else {
+        dir_reader child(&reader, name, path, opts_.follow_symlinks);
+        walk_dir(child, path, depth + 1);
+      }
+    }
+
+    path.resize(dir_size);
+    if (reader.error())
+      fail(path, reader.error());
+  }
+
+  void fail(const std::string &path, const error_code &ec) {
+    std::lock_guard<std::mutex> guard(mtx_);
+    errors_.push_back(path_error{path, ec});
+  }
+
+  Visitor &visit_;
+  const walk_options &opts_;
+  std::unique_ptr<task_group> tasks_;
+  std::mutex mtx_;
+  std::vector<path_error> errors_;
+};
+
+}  // namespace detail
+
+template <typename Visitor>
+static std::vector<path_error> walk(const std::string &dir, Visitor visit,
+                                    const walk_options &opts) {
+  detail::walker<Visitor> walker(visit, opts);
+  return walker.run(dir);
+}
+
 static string_list glob(const std::string &dir, bool recursive) {
   string_list files;
 
   if (!is_exist(dir))
     return files;
 
-  // recursive: not use fs::recursive_directory_iterator
-  for (auto &dir_entry : fs::directory_iterator(fs::path{dir})) {
-    auto filename = dir_entry.path().filename().string();
-    if (filename == "." || filename == "..")
-      continue;
+  walk_options opts;
+  opts.follow_symlinks = true;
+  walk(
+      dir,
+      [&files, recursive](const walk_entry &entry) {
+        files.emplace_back(entry.path);
+        return recursive;
+      },
+      opts);
+
+  return files;
+}
+
+static string_list find(const std::string &dir, const pattern_set &include,
+                        const pattern_set &exclude) {
+  // the entries' paths start with dir and a separator, like walk() joins
+  // them.
+  auto root_size = dir.size();
+  if (!dir.empty() && dir.back() != '/' &&
+      dir.back() != detail::dir_reader::kSeparator)
+    ++root_size;
+
+  string_list files;
+  walk(dir, [&](const walk_entry &entry) {
+    auto rel = entry.path.c_str() + root_size;
+    auto size = entry.path.size() - root_size;
+    auto is_dir = entry.type == entry_type::directory;
+    if (exclude.match(rel, size, is_dir))
+      return false;
 
-    files.emplace_back(dir_entry.path().string());
+    if (include.empty() || include.match(rel, size, is_dir))
+      files.emplace_back(entry.path);
+    return true;
+  });
+  return files;
+}
+
+namespace detail {
+
+struct file_stat {
+  entry_type type;
+  uint64_t bytes;
+  uint64_t allocated;
+  uint64_t dev;
+  uint64_t ino;
+  uint64_t nlink;
+  int64_t mtime;  // nanoseconds.
+};
+
+#ifdef __linux__
+static void to_file_stat(const struct stat &st, file_stat &out) {
+  if (S_ISREG(st.st_mode))
+    out.type = entry_type::file;
+  else if (S_ISDIR(st.st_mode))
+    out.type = entry_type::directory;
+  else if (S_ISLNK(st.st_mode))
+    out.type = entry_type::symlink;
+  else
+    out.type = entry_type::other;
+
+  out.bytes = static_cast<uint64_t>(st.st_size);
+  out.allocated = static_cast<uint64_t>(st.st_blocks) * 512;
+  out.dev = st.st_dev;
+  out.ino = st.st_ino;
+  out.nlink = st.st_nlink;
+  out.mtime = static_cast<int64_t>(st.st_mtim.tv_sec) * 1000000000 +
+              st.st_mtim.tv_nsec;
+}
+
+// name in the directory dir, path is for the other platforms.
+static bool stat_at(const dir_reader &dir, const char *name,
+                    const std::string &, file_stat &out, error_code &ec) {
+  struct stat st;
+  if (::fstatat(dir.fd(), name, &st, AT_SYMLINK_NOFOLLOW) < 0) {
+    set_errno(ec, errno);
+    return false;
+  }
+  to_file_stat(st, out);
+  return true;
+}
 
-    // recursive expand sub directory.
-    if (recursive && fs::is_directory(dir_entry.path())) {
-      auto tmp = glob(dir_entry.path().string(), recursive);
-      files.insert(files.end(), tmp.begin(), tmp.end());
+static bool stat_path(const std::string &path, file_stat &out,
+                      error_code &ec) {
+  struct stat st;
+  if (::fstatat(AT_FDCWD, path.c_str(), &st, AT_SYMLINK_NOFOLLOW) < 0) {
+    set_errno(ec, errno);
+    return false;
+  }
+  to_file_stat(st, out);
+  return true;
+}
+#else
+static bool stat_path(const std::string &path, file_stat &out,
+                      error_code &ec) {
+  fs::path p{path};
+  auto status = fs::symlink_status(p, ec);
+  if (ec)
+    return false;
+
+  out = file_stat{entry_type::other, 0, 0, 0, 0, 1, 0};
+  if (fs::is_regular_file(status)) {
+    out.type = entry_type::file;
+    out.bytes = fs::file_size(p, ec);
+    out.allocated = out.bytes;
+  }
+  else if (fs::is_directory(status)) {
+    out.type = entry_type::directory;
+  }
+  else if (fs::is_symlink(status)) {
+    out.type = entry_type::symlink;
+    return true;
+  }
+
+  auto mtime = fs::last_write_time(p, ec);
+  out.mtime = static_cast<int64_t>(mtime.time_since_epoch().count());
+  return !ec;
+}
+
+static bool stat_at(const dir_reader &, const char *, const std::string &path,
+                    file_stat &out, error_code &ec) {
+  return stat_path(path, out, ec);
+}
+#endif  // __linux__
+
+// a directory is a task: its entries are stat'ed (or its totals taken from
+// the cache), then its subdirectories become tasks of their own.
+class usage_walker {
+ public:
+  explicit usage_walker(const usage_options &opts) : opts_(opts) {
+    if (opts.threads > 0)
+      tasks_.reset(new task_group(opts.threads, 4096));
+  }
+
+  usage_result run(const std::string &p) {
+    file_stat st;
+    error_code ec;
+    if (!stat_path(p, st, ec)) {
+      fail(p, ec);
+    }
+    else if (st.type != entry_type::directory) {
+      usage_cache::dir own{};
+      add_entry(own, st);
+      add(own);
     }
+    else if (tasks_) {
+      tasks_->spawn([this, p, st]() { visit_dir(p, st); });
+      tasks_->wait();
+    }
+    else {
+      visit_dir(p, st);
+    }
+
+    result_.bytes = bytes_.load();
+    result_.allocated = allocated_.load();
+    result_.files = files_.load();
+    result_.dirs = dirs_.load();
+    return std::move(result_);
   }
 
-  return files;
+ private:
+  void fail(const std::string &path, const error_code &ec) {
+    std::lock_guard<std::mutex> guard(mtx_);
+    result_.errors.push_back(path_error{path, ec});
+  }
+
+  static std::string join(const std::string &dir, const std::string &name) {
+    if (!dir.empty() && dir.back() != '/' &&
+        dir.back() != dir_reader::kSeparator)
+      return dir + dir_reader::kSeparator + name;
+    return dir + name;
+  }
+
+  void descend(const std::string &path, const file_stat &st) {
+    if (tasks_)
+      tasks_->spawn([this, path, st]() { visit_dir(path, st); });
+    else
+      visit_dir(path, st);
+  }
+
+  void visit_dir(const std::string &path, const file_stat &self) {
+    dirs_.fetch_add(1, std::memory_order_relaxed);
+    allocated_.fetch_add(self.allocated, std::memory_order_relaxed);
+    if (!from_cache(path, self))
+      scan(path, self);
+  }
+
+  bool from_cache(const std::string &path, const file_stat &self) {
+    if (!opts_.cache)
+      return false;
+
+    usage_cache::dir own;
+    {
+      std::lock_guard<std::mutex> guard(opts_.cache->mtx_);
+      auto it = opts_.cache->dirs_.find(path);
+      if (it == opts_.cache->dirs_.end() || it->second.mtime != self.mtime ||
+          it->second.ino != self.ino)
+        return false;
+      own = it->second;
+    }
+
+    add(own);
+    for (auto &name : own.subdirs) {
+      auto child = join(path, name);
+      file_stat st;
+      error_code ec;
+      if (!stat_path(child, st, ec))
+        fail(child, ec);
+      else if (st.type == entry_type::directory)
+        descend(child, st);
+    }
+    return true;
+  }
+
+  void scan(const std::string &path, const file_stat &self) {
+    dir_reader reader(nullptr, nullptr, path, false);
+    usage_cache::dir own{};
+    own.mtime = self.mtime;
+    own.ino = self.ino;
+
+    std::vector<std::pair<std::string, file_stat>> subdirs;
+    auto failed = false;
+    const char *name = nullptr;
+    auto type = entry_type::other;
+    while (reader.next(name, type)) {
+      auto child = join(path, name);
+      file_stat st;
+      error_code ec;
+      if (!stat_at(reader, name, child, st, ec)) {
+        fail(child, ec);
+        failed = true;
+        continue;
+      }
+
+      if (st.type == entry_type::directory) {
+        own.subdirs.emplace_back(name);
+        subdirs.emplace_back(std::move(child), st);
+      }
+      else {
+        add_entry(own, st);
+      }
+    }
+
+    if (reader.error()) {
+      fail(path, reader.error());
+      failed = true;
+    }
+
+    add(own);
+    if (opts_.cache && !failed) {
+      std::lock_guard<std::mutex> guard(opts_.cache->mtx_);
+      opts_.cache->dirs_[path] = own;
+    }
+
+    for (auto &subdir : subdirs) {
+      descend(subdir.first, subdir.second);
+    }
+  }
+
+  // files with several links are kept apart, add() counts them once.
+  void add_entry(usage_cache::dir &own, const file_stat &st) {
+    auto bytes = st.type == entry_type::file ? st.bytes : 0;
+    own.files += 1;
+    if (opts_.count_links_once && st.nlink > 1) {
+      own.links.push_back(usage_cache::link{st.dev, st.ino, bytes,
+                                            st.allocated});
+      return;
+    }
+
+    own.bytes += bytes;
+    own.allocated += st.allocated;
+  }
+
+  void add(const usage_cache::dir &own) {
+    auto bytes = own.bytes;
+    auto allocated = own.allocated;
+    if (!own.links.empty()) {
+      std::lock_guard<std::mutex> guard(mtx_);
+      for (auto &l : own.links) {
+        if (!seen_.insert(std::make_pair(l.dev, l.ino)).second)
+          continue;
+
+        bytes += l.bytes;
+        allocated += l.allocated;
+      }
+    }
+
+    bytes_.fetch_add(bytes, std::memory_order_relaxed);
+    allocated_.fetch_add(allocated, std::memory_order_relaxed);
+    files_.fetch_add(own.files, std::memory_order_relaxed);
+  }
+
+  const usage_options &opts_;
+  std::unique_ptr<task_group> tasks_;
+
+  std::atomic<uint64_t> bytes_{0};
+  std::atomic<uint64_t> allocated_{0};
+  std::atomic<uint64_t> files_{0};
+  std::atomic<uint64_t> dirs_{0};
+
+  std::mutex mtx_;
+  std::set<std::pair<uint64_t, uint64_t>> seen_;
+  usage_result result_;
+};
+
+}  // namespace detail
+
+static usage_result disk_usage(const std::string &p,
+                               const usage_options &opts) {
+  detail::usage_walker walker(opts);
+  return walker.run(p);
+}
+
+namespace detail {
+
+#ifdef __linux__
+// sequential: depth first with openat/unlinkat relative to the parent.
+// parallel: a task per directory, the last task to finish in a directory
+// removes it and then tells its parent. either way a directory swapped for
+// a symlink midway is not followed: every directory is opened with
+// O_NOFOLLOW relative to its parent's descriptor, which stays open until
+// its subdirectories are gone.
+class tree_remover {
+ public:
+  explicit tree_remover(const remove_options &opts) {
+    if (opts.threads > 0)
+      tasks_.reset(new task_group(opts.threads, 4096));
+  }
+
+  remove_result run(const std::string &p) {
+    struct stat st;
+    if (::lstat(p.c_str(), &st) < 0) {
+      if (errno != ENOENT)
+        fail(p, errno);
+    }
+    else if (!S_ISDIR(st.st_mode)) {
+      if (::unlink(p.c_str()) < 0)
+        fail(p, errno);
+      else
+        files_.fetch_add(1, std::memory_order_relaxed);
+    }
+    else if (tasks_) {
+      std::shared_ptr<dir_node> root(new dir_node(p, std::string(), nullptr));
+      tasks_->spawn([this, root]() { remove_node(root); });
+      tasks_->wait();
+    }
+    else {
+      std::string path = p;
+      {
+        file_descriptor dir(open_dir(AT_FDCWD, path.c_str()));
+        if (dir.get() < 0)
+          fail(path, errno);
+        else {
+          dir_reader reader(dir, false);
+          remove_entries(reader, path);
+        }
+      }
+      remove_dir(path);
+    }
+
+    result_.files = files_.load();
+    result_.dirs = dirs_.load();
+    return std::move(result_);
+  }
+
+ private:
+  struct dir_node {
+    dir_node(std::string path, std::string name,
+             std::shared_ptr<dir_node> parent)
+        : path(std::move(path)),
+          name(std::move(name)),
+          parent(std::move(parent)) {}
+
+    std::string path;
+    // in the parent, empty for the root.
+    std::string name;
+    std::shared_ptr<dir_node> parent;
+    // opened by the node's task before it spawns the subdirectories.
+    std::shared_ptr<file_descriptor> fd;
+    // the node's own task and its subdirectories that are not gone yet.
+    std::atomic<size_t> pending{1};
+  };
+
+  static int open_dir(int dir_fd, const char *name) {
+    return ::openat(dir_fd, name,
+                    O_RDONLY | O_DIRECTORY | O_CLOEXEC | O_NOFOLLOW);
+  }
+
+  void fail(const std::string &path, int err) {
+    error_code ec;
+    set_errno(ec, err);
+    std::lock_guard<std::mutex> guard(mtx_);
+    result_.errors.push_back(path_error{path, ec});
+  }
+
+  void remove_dir(const std::string &path) {
+    if (::rmdir(path.c_str()) < 0)
+      fail(path, errno);
+    else
+      dirs_.fetch_add(1, std::memory_order_relaxed);
+  }
+
+  static void append(std::string &path, const char *name) {
+    if (!path.empty() && path.back() != '/')
+      path += '/';
+    path += name;
+  }
+
+  // path is the directory of reader on entry and on return.
+  void remove_entries(dir_reader &reader, std::string &path) {
+    auto dir_size = path.size();
+    const char *name = nullptr;
+    auto type = entry_type::other;
+    while (reader.next(name, type)) {
+      path.resize(dir_size);
+      append(path, name);
+      if (type != entry_type::directory) {
+        unlink_at(reader, name, path);
+        continue;
+      }
+
+      {
+        dir_reader child(&reader, name, path, false);
+        remove_entries(child, path);
+      }
+      if (::unlinkat(reader.fd(), name, AT_REMOVEDIR) < 0)
+        fail(path, errno);
+      else
+        dirs_.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    path.resize(dir_size);
+    if (reader.error())
+      fail(path, reader.error().value());
+  }
+
+  void unlink_at(dir_reader &reader, const char *name,
+                 const std::string &path) {
+    if (::unlinkat(reader.fd(), name, 0) < 0)
+      fail(path, errno);
+    else
+      files_.fetch_add(1, std::memory_order_relaxed);
+  }
+
+  void remove_node(const std::shared_ptr<dir_node> &node) {
+    auto &parent = node->parent;
+    auto fd = parent ? open_dir(parent->fd->get(), node->name.c_str())
+                     : open_dir(AT_FDCWD, node->path.c_str());
+    auto err = errno;
+    node->fd = std::make_shared<file_descriptor>(fd);
+    if (fd < 0) {
+      fail(node->path, err);
+      finish(node);
+      return;
+    }
+
+    {
+      dir_reader reader(*node->fd, false);
+      const char *name = nullptr;
+      auto type = entry_type::other;
+      while (reader.next(name, type)) {
+        auto path = node->path;
+        append(path, name);
+        if (type != entry_type::directory) {
+          unlink_at(reader, name, path);
+          continue;
+        }
+
+        node->pending.fetch_add(1);
+        std::shared_ptr<dir_node> child(
+            new dir_node(std::move(path), name, node));
+        tasks_->spawn([this, child]() { remove_node(child); });
+      }
+
+      if (reader.error())
+        fail(node->path, reader.error().value());
+    }
+    finish(node);
+  }
+
+  // the directory is closed before it is removed from its parent.
+  void finish(std::shared_ptr<dir_node> node) {
+    while (node && node->pending.fetch_sub(1) == 1) {
+      node->fd.reset();
+      auto parent = node->parent;
+      if (!parent)
+        remove_dir(node->path);
+      else if (::unlinkat(parent->fd->get(), node->name.c_str(),
+                          AT_REMOVEDIR) < 0)
+        fail(node->path, errno);
+      else
+        dirs_.fetch_add(1, std::memory_order_relaxed);
+      node = parent;
+    }
+  }
+
+  std::unique_ptr<task_group> tasks_;
+  std::atomic<uint64_t> files_{0};
+  std::atomic<uint64_t> dirs_{0};
+  std::mutex mtx_;
+  remove_result result_;
+};
+#else
+// depth first on the calling thread, symlinks are removed like files.
+class tree_remover {
+ public:
+  explicit tree_remover(const remove_options &) {}
+
+  remove_result run(const std::string &p) {
+    error_code ec;
+    auto st = fs::symlink_status(fs::path{p}, ec);
+    // nothing to remove if p does not exist.
+    if (!fs::status_known(st))
+      result_.errors.push_back(path_error{p, ec});
+    else if (fs::is_directory(st))
+      remove_dir(fs::path{p});
+    else if (fs::exists(st))
+      remove(fs::path{p}, result_.files);
+    return std::move(result_);
+  }
+
+ private:
+  void remove_dir(const fs::path &dir) {
+    error_code ec;
+    for (fs::directory_iterator it(dir, ec), end; !ec && it != end;
+         it.increment(ec)) {
+      auto path = it->path();
+      error_code type_ec;
+      if (fs::is_directory(fs::symlink_status(path, type_ec)))
+        remove_dir(path);
+      else
+        remove(path, result_.files);
+    }
+    if (ec)
+      result_.errors.push_back(path_error{dir.string(), ec});
+
+    remove(dir, result_.dirs);
+  }
+
+  void remove(const fs::path &path, uint64_t &count) {
+    error_code ec;
+    if (fs::remove(path, ec))
+      ++count;
+    else if (ec)
+      result_.errors.push_back(path_error{path.string(), ec});
+  }
+
+  remove_result result_;
+};
+#endif  // __linux__
+
+// one background thread for remove_tree_later(), it finishes the queued
+// removals before the program exits.
+static function_queue &trash_queue() {
+  static function_queue queue([]() {
+    event_queue_options opts;
+    opts.thread_count = 1;
+    opts.drain_on_stop = true;
+    return opts;
+  }());
+  return queue;
+}
+
+}  // namespace detail
+
+static remove_result remove_tree(const std::string &p,
+                                 const remove_options &opts) {
+  detail::tree_remover remover(opts);
+  return remover.run(p);
+}
+
+static std::future<remove_result> remove_tree_later(
+    const std::string &p, const std::string &trash_dir,
+    const remove_options &opts) {
+  static std::atomic<uint64_t> next_id{0};
+
+  auto promise = std::make_shared<std::promise<remove_result>>();
+  auto future = promise->get_future();
+
+  // unique among processes sharing the trash too.
+  auto stamp = std::chrono::system_clock::now().time_since_epoch().count();
+  auto name = fs::path{p}.filename().string() + "." +
+              std::to_string(stamp) + "." + std::to_string(next_id++);
+  auto trashed = (fs::path{trash_dir} / name).string();
+
+  error_code ec;
+  fs::create_directories(fs::path{trash_dir}, ec);
+  if (!ec)
+    fs::rename(fs::path{p}, fs::path{trashed}, ec);
+  if (ec) {
+    remove_result result;
+    result.errors.push_back(path_error{p, ec});
+    promise->set_value(std::move(result));
+    return future;
+  }
+
+  auto threads = opts.threads;
+  detail::trash_queue().enqueue(inline_event([promise, trashed, threads]() {
+    remove_options background;
+    background.threads = threads;
+    promise->set_value(remove_tree(trashed, background));
+  }));
+  return future;
+}
+
+inline mapped_file &mapped_file::operator=(mapped_file &&other) {
+  if (this == &other)
+    return *this;
+
+  close();
+  map_ = other.map_;
+  size_ = other.size_;
+  buffer_ = std::move(other.buffer_);
+  open_ = other.open_;
+  ec_ = other.ec_;
+  other.map_ = nullptr;
+  other.size_ = 0;
+  other.buffer_.clear();
+  other.open_ = false;
+  return *this;
+}
+
+inline bool mapped_file::open(const std::string &p, access_hint hint) {
+  close();
+  ec_.clear();
+
+#ifdef __linux__
+  detail::file_descriptor fd(::open(p.c_str(), O_RDONLY | O_CLOEXEC));
+  struct stat st;
+  if (fd.get() < 0 || ::fstat(fd.get(), &st) < 0) {
+    detail::set_errno(ec_, errno);
+    return false;
+  }
+
+  // an empty regular file may still have contents, like those in /proc.
+  if (S_ISREG(st.st_mode) && st.st_size > 0) {
+    auto size = static_cast<size_t>(st.st_size);
+    auto addr = ::mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd.get(), 0);
+    if (addr != MAP_FAILED) {
+      if (hint == access_hint::sequential)
+        ::madvise(addr, size, MADV_SEQUENTIAL);
+      else if (hint == access_hint::random)
+        ::madvise(addr, size, MADV_RANDOM);
+      map_ = addr;
+      size_ = size;
+      open_ = true;
+      return true;
+    }
+  }
+
+  char chunk[64 * 1024];
+  for (;;) {
+    auto n = ::read(fd.get(), chunk, sizeof(chunk));
+    if (n == 0)
+      break;
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      detail::set_errno(ec_, errno);
+      buffer_.clear();
+      return false;
+    }
+    buffer_.append(chunk, static_cast<size_t>(n));
+  }
+  open_ = true;
+  return true;
+#else
+  (void)hint;
+  return read(p);
+#endif  // __linux__
+}
+
+inline bool mapped_file::read(const std::string &p) {
+  // no size up front: pipes and special files only end at eof.
+  std::ifstream in(p.c_str(), std::ifstream::in | std::ifstream::binary);
+  if (!in.is_open()) {
+    // the reason, if status() can tell.
+    if (fs::status_known(fs::status(fs::path{p}, ec_)) && !ec_)
+      set_io_error();
+    return false;
+  }
+
+  char chunk[64 * 1024];
+  while (in.read(chunk, sizeof(chunk)) || in.gcount() > 0)
+    buffer_.append(chunk, static_cast<size_t>(in.gcount()));
+
+  if (in.bad()) {
+    set_io_error();
+    buffer_.clear();
+    return false;
+  }
+
+  open_ = true;
+  return true;
+}
+
+inline void mapped_file::set_io_error() {
+#if __cplusplus >= 201703L
+  ec_ = std::make_error_code(std::errc::io_error);
+#else
+  ec_ = boost::system::errc::make_error_code(boost::system::errc::io_error);
+#endif
+}
+
+inline void mapped_file::close() {
+#ifdef __linux__
+  if (map_)
+    ::munmap(map_, size_);
+#endif  // __linux__
+  map_ = nullptr;
+  size_ = 0;
+  buffer_.clear();
+  buffer_.shrink_to_fit();
+  open_ = false;
 }
 
 }  // namespace shutil
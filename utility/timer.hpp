@@ -0,0 +1,435 @@
+﻿/*
+
+Copyright (c) 2024 lemon19900815@buerjia
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+
+*/
+
+#ifndef __UTILITY_TIMER_HPP__
+#define __UTILITY_TIMER_HPP__
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+#include "event_queue.hpp"
+
+namespace utility {
+
+// hierarchical timing wheel: 4 levels of 256 slots, O(1) add and cancel.
+// the timer thread sleeps until the next occupied tick, takes the whole slot
+// and fires every callback at its exact deadline: it sleeps until shortly
+// before, then spins the rest of the way (precision well below 1ms).
+// callbacks run on the timer thread unless a dispatcher hands them over,
+// e.g. to an event_queue with dispatch_to().
+class timer final {
+ public:
+  using clock = std::chrono::steady_clock;
+  using timer_id = uint64_t;
+  using callback = std::function<void()>;
+  using dispatcher = std::function<void(callback)>;
+
+  explicit timer(dispatcher dispatch = nullptr,
+                 clock::duration tick = std::chrono::milliseconds(1))
+      : dispatch_(std::move(dispatch)), tick_(tick), base_(clock::now()) {
+    for (auto &level : heads_) {
+      for (auto &head : level)
+        head = kNil;
+    }
+
+    thread_ = std::thread(&timer::run, this);
+  }
+
+  ~timer() { stop(); }
+
+  timer(const timer &) = delete;
+  timer &operator=(const timer &) = delete;
+
+  // floating-point delays round up to the clock's tick.
+  template <typename Rep, typename Period>
+  timer_id add(std::chrono::duration<Rep, Period> delay, callback cb) {
+    return add_at(clock::now() + detail::ceil_duration<clock::duration>(delay),
+                  std::move(cb));
+  }
+
+  timer_id add_at(clock::time_point deadline, callback cb) {
+    std::lock_guard<std::mutex> guard(mtx_);
+    auto index = alloc_node();
+    auto &n = nodes_[index];
+    n.deadline = deadline;
+    n.expire = tick_of(deadline);
+    n.cb = std::move(cb);
+
+    place(index);
+    ++count_;
+
+    if (n.expire < target_tick_)
+      cv_.notify_one();
+
+    return make_id(index, n.gen);
+  }
+
+  // false if the timer already fired, is firing or was cancelled.
+  bool cancel(timer_id id) {
+    std::lock_guard<std::mutex> guard(mtx_);
+    auto index = static_cast<uint32_t>(id);
+    if (index >= nodes_.size())
+      return false;
+
+    auto &n = nodes_[index];
+    if (n.gen != static_cast<uint32_t>(id >> 32) || n.level < 0)
+      return false;
+
+    unlink(index);
+    free_node(index);
+    --count_;
+    return true;
+  }
+
+  // pending timers.
+  size_t size() {
+    std::lock_guard<std::mutex> guard(mtx_);
+    return count_;
+  }
+
+  // pending timers are dropped, must not be called from a callback.
+  void stop() {
+    {
+      std::lock_guard<std::mutex> guard(mtx_);
+      stop_ = true;
+    }
+    cv_.notify_all();
+
+    if (thread_.joinable())
+      thread_.join();
+  }
+
+ private:
+  static constexpr int kLevels = 4;
+  static constexpr int kSlotBits = 8;
+  static constexpr uint32_t kSlots = 1u << kSlotBits;
+  static constexpr uint32_t kSlotMask = kSlots - 1;
+  static constexpr uint32_t kNil = UINT32_MAX;
+  static constexpr uint64_t kMaxDelta = (1ull << (kLevels * kSlotBits)) - 1;
+  static constexpr uint64_t kIdle = UINT64_MAX;
+
+  // sleep this close to a deadline, spin the rest.
+  static constexpr std::chrono::microseconds spin_threshold() {
+    return std::chrono::microseconds(200);
+  }
+
+  struct node {
+    clock::time_point deadline;
+    uint64_t expire{0};
+    callback cb;
+    uint32_t prev{kNil};
+    uint32_t next{kNil};
+    uint32_t gen{1};
+    int16_t level{-1};
+    uint16_t slot{0};
+  };
+
+  struct due_timer {
+    clock::time_point deadline;
+    callback cb;
+  };
+
+  static timer_id make_id(uint32_t index, uint32_t gen) {
+    return (static_cast<uint64_t>(gen) << 32) | index;
+  }
+
+  uint64_t tick_of(clock::time_point tp) const {
+    if (tp <= base_)
+      return 0;
+    return static_cast<uint64_t>((tp - base_) / tick_);
+  }
+
+  clock::time_point tick_start(uint64_t tick) const {
+    return base_ + tick_ * static_cast<clock::rep>(tick);
+  }
+
+  uint32_t alloc_node() {
+    if (free_ != kNil) {
+      auto index = free_;
+      free_ = nodes_[index].next;
+      nodes_[index].next = kNil;
+      return index;
+    }
+
+    nodes_.emplace_back();
+    return static_cast<uint32_t>(nodes_.size() - 1);
+  }
+
+  void free_node(uint32_t index) {
+    auto &n = nodes_[index];
+    n.cb = nullptr;
+    n.level = -1;
+    ++n.gen;
+    n.next = free_;
+    free_ = index;
+  }
+
+  // the level is picked by the distance to the current tick, the slot by
+  // the matching 8 bits of the expire tick. a level-N slot cascades down
+  // when the lower levels wrap around onto it.
+  void place(uint32_t index) {
+    auto &n = nodes_[index];
+    auto expire = std::max(n.expire, cur_tick_);
+    expire = std::min(expire, cur_tick_ + kMaxDelta);
+    auto delta = expire - cur_tick_;
+
+    int level = 0;
+    while (level < kLevels - 1 && delta >> ((level + 1) * kSlotBits))
+      ++level;
+
+    auto slot = static_cast<uint32_t>(expire >> (level * kSlotBits)) &
+                kSlotMask;
+    auto &head = heads_[level][slot];
+
+    n.level = static_cast<int16_t>(level);
+    n.slot = static_cast<uint16_t>(slot);
+    n.prev = kNil;
+    n.next = head;
+    if (head != kNil)
+      nodes_[head].prev = index;
+    head = index;
+
+    if (level == 0)
+      occupied_[slot / 64] |= 1ull << (slot % 64);
+  }
+
+  void unlink(uint32_t index) {
+    auto &n = nodes_[index];
+    auto &head = heads_[n.level][n.slot];
+
+    if (n.prev != kNil)
+      nodes_[n.prev].next = n.next;
+    else
+      head = n.next;
+
+    if (n.next != kNil)
+      nodes_[n.next].prev = n.prev;
+
+    if (n.level == 0 && head == kNil)
+      occupied_[n.slot / 64] &= ~(1ull << (n.slot % 64));
+
+    n.level = -1;
+    n.prev = n.next = kNil;
+  }
+
+  // take the whole slot list, the nodes stay owned by the caller.
+  uint32_t detach(int level, uint32_t slot) {
+    auto list = heads_[level][slot];
+    heads_[level][slot] = kNil;
+    if (level == 0)
+      occupied_[slot / 64] &= ~(1ull << (slot % 64));
+    return list;
+  }
+
+  // the first tick from cur_tick_ whose level-0 slot is occupied, or the
+  // next wrap-around of level 0 where the upper levels cascade (which may be
+  // cur_tick_ itself).
+  uint64_t next_tick() const {
+    auto pos = static_cast<uint32_t>(cur_tick_) & kSlotMask;
+    if (pos == 0)
+      return cur_tick_;
+
+    for (auto word = pos / 64; word < kSlots / 64; ++word) {
+      auto bits = occupied_[word];
+      if (word == pos / 64)
+        bits &= ~0ull << (pos % 64);
+
+      if (bits) {
+        auto slot = word * 64 + ctz(bits);
+        return (cur_tick_ & ~static_cast<uint64_t>(kSlotMask)) + slot;
+      }
+    }
+
+    return (cur_tick_ | kSlotMask) + 1;
+  }
+
+  static uint32_t ctz(uint64_t bits) {
+    uint32_t n = 0;
+    while (!(bits & 1)) {
+      bits >>= 1;
+      ++n;
+    }
+    return n;
+  }
+
+  // cascade the upper levels on wrap-around, then collect the due slot.
+  void advance(uint64_t tick, std::vector<due_timer> &due) {
+    cur_tick_ = tick;
+
+    for (int level = kLevels - 1; level > 0; --level) {
+      auto mask = (1ull << (level * kSlotBits)) - 1;
+      if (tick & mask)
+        continue;
+
+      auto slot = static_cast<uint32_t>(tick >> (level * kSlotBits)) &
+                  kSlotMask;
+      auto index = detach(level, slot);
+      while (index != kNil) {
+        auto next = nodes_[index].next;
+        place(index);
+        index = next;
+      }
+    }
+
+    auto index = detach(0, static_cast<uint32_t>(tick) & kSlotMask);
+    while (index != kNil) {
+      auto &n = nodes_[index];
+      auto next = n.next;
+
+      // clamped beyond the wheel range, not due yet.
+      if (n.expire > tick) {
+        place(index);
+      }
+      else {
+        due.push_back(due_timer{n.deadline, std::move(n.cb)});
+        free_node(index);
+        --count_;
+      }
+      index = next;
+    }
+
+    cur_tick_ = tick + 1;
+  }
+
+  static void sleep_until(clock::time_point deadline) {
+    auto now = clock::now();
+    if (deadline - now > spin_threshold())
+      std::this_thread::sleep_until(deadline - spin_threshold());
+
+    while (clock::now() < deadline)
+      std::this_thread::yield();
+  }
+
+  void run() {
+    std::vector<due_timer> due;
+    std::unique_lock<std::mutex> lock(mtx_);
+
+    while (!stop_) {
+      if (count_ == 0) {
+        cur_tick_ = std::max(cur_tick_, tick_of(clock::now()));
+        target_tick_ = kIdle;
+        cv_.wait(lock, [this]() {
+          return stop_ || count_ > 0;
+        });
+        continue;
+      }
+
+      target_tick_ = next_tick();
+      auto wake = tick_start(target_tick_) - spin_threshold();
+      if (clock::now() < wake) {
+        cv_.wait_until(lock, wake);
+        continue;
+      }
+
+      advance(target_tick_, due);
+      target_tick_ = kIdle;
+      if (due.empty())
+        continue;
+
+      std::sort(due.begin(), due.end(),
+                [](const due_timer &a, const due_timer &b) {
+                  return a.deadline < b.deadline;
+                });
+
+      lock.unlock();
+      for (auto &t : due) {
+        sleep_until(t.deadline);
+        if (dispatch_)
+          dispatch_(std::move(t.cb));
+        else
+          t.cb();
+      }
+      due.clear();
+      lock.lock();
+    }
+  }
+
+ private:
+  dispatcher dispatch_;
+  clock::duration tick_;
+  clock::time_point base_;
+
+  std::mutex mtx_;
+  std::condition_variable cv_;
+  bool stop_{false};
+
+  uint64_t cur_tick_{0};
+  uint64_t target_tick_{kIdle};
+  size_t count_{0};
+
+  std::vector<node> nodes_;
+  uint32_t free_{kNil};
+  uint32_t heads_[kLevels][kSlots];
+  uint64_t occupied_[kSlots / 64]{};
+
+  std::thread thread_;
+};
+
+namespace detail {
+
+class timer_handler : public event_handler {
+ public:
+  explicit timer_handler(timer::callback cb) : cb_(std::move(cb)) {}
+
+  virtual void process() override { cb_(); }
+
+ private:
+  timer::callback cb_;
+};
+
+template <typename Queue>
+void enqueue_callback(Queue &eq, timer::callback cb, std::true_type) {
+  eq.enqueue(std::make_shared<timer_handler>(std::move(cb)));
+}
+
+template <typename Queue>
+void enqueue_callback(Queue &eq, timer::callback cb, std::false_type) {
+  eq.enqueue(typename Queue::event_type(std::move(cb)));
+}
+
+}  // namespace detail
+
+// run the expired callbacks on an event_queue (handler pointers) or a
+// function_queue instead of the timer thread.
+template <typename Queue>
+timer::dispatcher dispatch_to(Queue &eq) {
+  using is_handler =
+      std::is_same<typename Queue::event_type, event_handler::ptr>;
+  return [&eq](timer::callback cb) {
+    detail::enqueue_callback(eq, std::move(cb), is_handler());
+  };
+}
+
+}  // namespace utility
+
+#endif  // __UTILITY_TIMER_HPP__